@@ -0,0 +1,569 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * load generator : connections spread over event loop threads, each
+ * keeps up to a pipeline depth of requests in flight, cycling through
+ * the given URIs. One JSON line per run on stdout, compared against
+ * the same scenario of a baseline file if one is given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define PIPE_MAX	64
+#define RBUF_SIZE	65536
+#define URI_MAX		32
+
+struct conn {
+	int			fd;
+	int			inflight;		/* requests sent, not answered */
+	int			head;			/* oldest of sent[] */
+	uint64_t	sent[PIPE_MAX];	/* send times, ns */
+	char		*rbuf;
+	size_t		rlen;
+	long long	remain;			/* body bytes of the current response */
+	int			inbody;
+	int			close;			/* server closes after the response */
+	char		out[PIPE_MAX * 256];
+	size_t		olen;
+	size_t		ooff;
+};
+
+struct thread {
+	pthread_t	tid;
+	int			ep;
+	int			nconn;
+	struct conn	*conns;
+	unsigned	next;			/* next uri */
+	uint64_t	requests;
+	uint64_t	errors;			/* 4xx, 5xx, failed connections */
+	uint64_t	bytes;
+	uint64_t	*lat;			/* latencies, ns */
+	size_t		nlat;
+	size_t		lsize;
+};
+
+static struct addrinfo *addr;
+static const char *uris[URI_MAX];
+static int nuris;
+static const char *host = "localhost";
+static int depth = 1;
+static int keepalive = 1;
+static uint64_t deadline;
+
+static uint64_t now(void);
+static void *run(void *);
+static int conn_open(struct thread *, struct conn *);
+static void conn_close(struct thread *, struct conn *, int);
+static int conn_send(struct thread *, struct conn *);
+static int conn_flush(struct conn *);
+static int conn_read(struct thread *, struct conn *);
+static int response(struct thread *, struct conn *);
+static int cmp(const void *, const void *);
+static uint64_t pct(const uint64_t *, size_t, double);
+static int compare(const char *, const char *, double, double, double);
+static double field(const char *, const char *);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: load [-k] [-c conns] [-t threads] [-p depth] "
+			"[-d seconds] [-H host]\n"
+			"\t[-n name] [-B baseline] [-T percent] [-u uri ...] "
+			"host port\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo hints;
+	struct thread *t;
+	const char *name = "load", *baseline = NULL;
+	uint64_t requests = 0, errors = 0, bytes = 0, *lat, t0, t1;
+	size_t nlat = 0, n;
+	double secs, rps, tol = 10.0;
+	int i, ch, error, nconn = 32, nthreads = 1, duration = 5;
+
+	while ((ch = getopt(argc, argv, "kc:t:p:d:H:n:B:T:u:")) != -1)
+	{
+		switch (ch) {
+			case 'k':
+				keepalive = 0;
+				break;
+			case 'c':
+				nconn = atoi(optarg);
+				break;
+			case 't':
+				nthreads = atoi(optarg);
+				break;
+			case 'p':
+				depth = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 'H':
+				host = optarg;
+				break;
+			case 'n':
+				name = optarg;
+				break;
+			case 'B':
+				baseline = optarg;
+				break;
+			case 'T':
+				tol = atof(optarg);
+				break;
+			case 'u':
+				if (nuris == URI_MAX)
+					errx(EXIT_FAILURE, "too many uris");
+				uris[nuris++] = optarg;
+				break;
+			default:
+				usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 2 || nconn < 1 || nthreads < 1 || duration < 1 ||
+			depth < 1 || depth > PIPE_MAX)
+		usage();
+	if (nuris == 0)
+		uris[nuris++] = "/";
+	if (nthreads > nconn)
+		nthreads = nconn;
+	/* one request per connection when closing */
+	if (!keepalive)
+		depth = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[0], argv[1], &hints, &addr)) != 0)
+		errx(EXIT_FAILURE, "%s: %s", argv[0], gai_strerror(error));
+
+	if (!(t = calloc(nthreads, sizeof(*t))))
+		err(EXIT_FAILURE, "calloc");
+
+	t0 = now();
+	deadline = t0 + (uint64_t)duration * 1000000000;
+	for (i = 0; i < nthreads; i++)
+	{
+		t[i].nconn = nconn / nthreads + (i < nconn % nthreads);
+		t[i].next = i;
+		if (pthread_create(&t[i].tid, NULL, run, &t[i]) != 0)
+			err(EXIT_FAILURE, "pthread_create");
+	}
+	for (i = 0; i < nthreads; i++)
+	{
+		pthread_join(t[i].tid, NULL);
+		requests += t[i].requests;
+		errors += t[i].errors;
+		bytes += t[i].bytes;
+		nlat += t[i].nlat;
+	}
+	t1 = now();
+
+	if (!(lat = malloc((nlat + 1) * sizeof(*lat))))
+		err(EXIT_FAILURE, "malloc");
+	for (n = 0, i = 0; i < nthreads; i++)
+	{
+		memcpy(lat + n, t[i].lat, t[i].nlat * sizeof(*lat));
+		n += t[i].nlat;
+		free(t[i].lat);
+	}
+	qsort(lat, nlat, sizeof(*lat), cmp);
+
+	secs = (t1 - t0) / 1e9;
+	rps = requests / secs;
+	printf("{\"name\":\"%s\",\"conns\":%d,\"threads\":%d,\"pipeline\":%d,"
+			"\"keepalive\":%s,\"seconds\":%.3f,\"requests\":%llu,"
+			"\"errors\":%llu,\"rps\":%.1f,\"mbps\":%.2f,"
+			"\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+			name, nconn, nthreads, depth, keepalive ? "true" : "false",
+			secs, (unsigned long long)requests, (unsigned long long)errors,
+			rps, bytes / secs / 1e6,
+			pct(lat, nlat, 0.50) / 1e3, pct(lat, nlat, 0.99) / 1e3,
+			pct(lat, nlat, 0.999) / 1e3);
+	fflush(stdout);
+
+	if (requests == 0)
+		errx(EXIT_FAILURE, "%s: no response", name);
+
+	if (baseline)
+		return compare(baseline, name, rps, pct(lat, nlat, 0.99) / 1e3, tol);
+
+	return EXIT_SUCCESS;
+}
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * event loop of a thread, until the deadline
+ */
+static void *
+run(void *arg)
+{
+	struct thread *t = arg;
+	struct epoll_event evs[64];
+	struct conn *c;
+	uint64_t ms;
+	int i, n;
+
+	if ((t->ep = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		err(EXIT_FAILURE, "epoll_create1");
+	if (!(t->conns = calloc(t->nconn, sizeof(*t->conns))))
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0; i < t->nconn; i++)
+	{
+		if (!(t->conns[i].rbuf = malloc(RBUF_SIZE)))
+			err(EXIT_FAILURE, "malloc");
+		t->conns[i].fd = -1;
+		if (conn_open(t, &t->conns[i]) == -1)
+			err(EXIT_FAILURE, "connect");
+	}
+
+	while ((ms = now()) < deadline)
+	{
+		n = epoll_wait(t->ep, evs, 64, (deadline - ms) / 1000000 + 1);
+		for (i = 0; i < n; i++)
+		{
+			c = evs[i].data.ptr;
+			if (c->fd == -1)
+				continue;
+			if ((evs[i].events & EPOLLOUT) && conn_flush(c) == -1) {
+				conn_close(t, c, 1);
+				continue;
+			}
+			if ((evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) &&
+					conn_read(t, c) == -1)
+				conn_close(t, c, 1);
+		}
+	}
+
+	for (i = 0; i < t->nconn; i++)
+	{
+		if (t->conns[i].fd != -1)
+			close(t->conns[i].fd);
+		free(t->conns[i].rbuf);
+	}
+	free(t->conns);
+	close(t->ep);
+
+	return NULL;
+}
+
+static int
+conn_open(struct thread *t, struct conn *c)
+{
+	struct epoll_event ev;
+
+	if ((c->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK |
+					SOCK_CLOEXEC, addr->ai_protocol)) == -1)
+		return -1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (int[]){1}, sizeof(int));
+
+	if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) == -1 &&
+			errno != EINPROGRESS) {
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+
+	c->inflight = c->head = 0;
+	c->rlen = c->olen = c->ooff = 0;
+	c->inbody = c->close = 0;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(t->ep, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+		err(EXIT_FAILURE, "epoll_ctl");
+
+	/* queued until the connection is up */
+	while (c->inflight < depth)
+		conn_send(t, c);
+
+	return 0;
+}
+
+/*
+ * failed connections count their requests in flight as errors
+ */
+static void
+conn_close(struct thread *t, struct conn *c, int failed)
+{
+	if (failed)
+		t->errors += c->inflight ? c->inflight : 1;
+
+	close(c->fd);
+	c->fd = -1;
+
+	if (now() < deadline && conn_open(t, c) == -1) {
+		t->errors++;
+		c->fd = -1;
+	}
+}
+
+/*
+ * queue the next request and send what is queued
+ */
+static int
+conn_send(struct thread *t, struct conn *c)
+{
+	const char *uri = uris[t->next++ % nuris];
+	int n;
+
+	if (c->ooff == c->olen)
+		c->olen = c->ooff = 0;
+
+	n = snprintf(c->out + c->olen, sizeof(c->out) - c->olen,
+			"GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", uri, host,
+			keepalive ? "" : "Connection: close\r\n");
+	if (n < 0 || (size_t)n >= sizeof(c->out) - c->olen)
+		errx(EXIT_FAILURE, "%s: request too long", uri);
+
+	c->olen += n;
+	c->sent[(c->head + c->inflight) % PIPE_MAX] = now();
+	c->inflight++;
+
+	return conn_flush(c);
+}
+
+static int
+conn_flush(struct conn *c)
+{
+	ssize_t n;
+
+	while (c->ooff < c->olen)
+	{
+		n = send(c->fd, c->out + c->ooff, c->olen - c->ooff, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK ||
+					errno == ENOTCONN)
+				return 0;
+			return -1;
+		}
+		c->ooff += n;
+	}
+
+	return 0;
+}
+
+/*
+ * read until EAGAIN, answering responses as they complete
+ */
+static int
+conn_read(struct thread *t, struct conn *c)
+{
+	ssize_t n;
+	int ret;
+
+	for (;;)
+	{
+		n = read(c->fd, c->rbuf + c->rlen, RBUF_SIZE - c->rlen);
+		if (n == 0) {
+			if (c->inflight > 0)
+				return -1;
+			conn_close(t, c, 0);
+			return 0;
+		}
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		c->rlen += n;
+		t->bytes += n;
+
+		while ((ret = response(t, c)) > 0)
+			;
+		if (ret == -1)
+			return -1;
+		if (c->fd == -1)
+			return 0;
+	}
+}
+
+/*
+ * consume one response of rbuf : 1 when done, 0 for more input
+ */
+static int
+response(struct thread *t, struct conn *c)
+{
+	char *p, *end, *line;
+	size_t hlen, k;
+	int code;
+
+	if (!c->inbody)
+	{
+		if (c->rlen < 4 || !(end = memmem(c->rbuf, c->rlen, "\r\n\r\n", 4))) {
+			if (c->rlen == RBUF_SIZE)
+				return -1;
+			return 0;
+		}
+		*end = '\0';
+		hlen = end + 4 - c->rbuf;
+
+		if (sscanf(c->rbuf, "HTTP/1.%*d %d", &code) != 1)
+			return -1;
+		if (code >= 400)
+			t->errors++;
+
+		c->remain = 0;
+		for (line = strstr(c->rbuf, "\r\n"); line; line = strstr(line, "\r\n"))
+		{
+			line += 2;
+			if (!strncasecmp(line, "Content-Length:", 15))
+				c->remain = strtoll(line + 15, NULL, 10);
+			else if (!strncasecmp(line, "Connection:", 11) &&
+					(p = strcasestr(line + 11, "close")) &&
+					(!strstr(line, "\r\n") || p < strstr(line, "\r\n")))
+				c->close = 1;
+		}
+
+		memmove(c->rbuf, c->rbuf + hlen, c->rlen - hlen);
+		c->rlen -= hlen;
+		c->inbody = 1;
+	}
+
+	k = (size_t)c->remain < c->rlen ? (size_t)c->remain : c->rlen;
+	memmove(c->rbuf, c->rbuf + k, c->rlen - k);
+	c->rlen -= k;
+	c->remain -= k;
+	if (c->remain > 0)
+		return 0;
+
+	/* answered */
+	c->inbody = 0;
+	if (t->nlat == t->lsize) {
+		t->lsize = t->lsize ? 2 * t->lsize : 65536;
+		if (!(t->lat = realloc(t->lat, t->lsize * sizeof(*t->lat))))
+			err(EXIT_FAILURE, "realloc");
+	}
+	t->lat[t->nlat++] = now() - c->sent[c->head];
+	c->head = (c->head + 1) % PIPE_MAX;
+	c->inflight--;
+	t->requests++;
+
+	if (c->close || !keepalive) {
+		conn_close(t, c, 0);
+		return 0;
+	}
+
+	if (now() < deadline && conn_send(t, c) == -1)
+		return -1;
+
+	return 1;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+pct(const uint64_t *lat, size_t n, double p)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+	i = p * n;
+	return lat[i < n ? i : n - 1];
+}
+
+/*
+ * report against the scenario line of the baseline, 2 for a
+ * regression beyond tol percent in req/s or p99
+ */
+static int
+compare(const char *file, const char *name, double rps, double p99, double tol)
+{
+	FILE *fp;
+	char line[1024], key[128];
+	double brps, bp99, drps, dp99;
+	int ret = EXIT_SUCCESS;
+
+	if (!(fp = fopen(file, "r"))) {
+		warn("%s", file);
+		return EXIT_SUCCESS;
+	}
+
+	snprintf(key, sizeof(key), "\"name\":\"%s\",", name);
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (!strstr(line, key))
+			continue;
+
+		brps = field(line, "rps");
+		bp99 = field(line, "p99_us");
+		drps = brps > 0 ? (rps - brps) * 100 / brps : 0;
+		dp99 = bp99 > 0 ? (p99 - bp99) * 100 / bp99 : 0;
+
+		if (drps < -tol || dp99 > tol)
+			ret = 2;
+		fprintf(stderr, "%-20s rps %+6.1f%%  p99 %+6.1f%%%s\n", name,
+				drps, dp99, ret ? "  REGRESSION" : "");
+		fclose(fp);
+		return ret;
+	}
+
+	fprintf(stderr, "%-20s not in %s\n", name, file);
+	fclose(fp);
+	return ret;
+}
+
+static double
+field(const char *line, const char *name)
+{
+	char key[64];
+	const char *p;
+
+	snprintf(key, sizeof(key), "\"%s\":", name);
+	if (!(p = strstr(line, key)))
+		return 0;
+	return strtod(p + strlen(key), NULL);
+}
@@ -0,0 +1,506 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * request path microbenchmarks over the request heads of corpus.txt :
+ * ns, heap allocations and system calls per operation. The server
+ * sources are built in, client.c included for its static helpers.
+ * Allocations are counted by interposing malloc, system calls by
+ * tracing a forked run with ptrace(2).
+ */
+
+#include "../httpd/client.c"
+
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/ptrace.h>
+#include <signal.h>
+
+#define ITER		200000
+#define SYS_ITER	2000
+#define CORPUS_MAX	64
+#define MARK		SYS_getppid		/* brackets the traced operations */
+
+struct httpd conf;
+pthread_mutex_t httpd_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+struct req {
+	char			*data;
+	size_t			len;
+	struct Client	*c;		/* parsed copy, tokens terminated */
+	char			*uri;
+	char			*host;
+};
+
+struct bench {
+	const char	*name;
+	void		(*op)(const struct req *);
+};
+
+static const char *files[] = {
+	"index.html", "css/site.css", "img/logo.png", "js/app.js",
+	"robots.txt", "favicon.ico", "dl/archive.tar.gz",
+};
+
+static struct req corpus[CORPUS_MAX];
+static int ncorpus;
+static struct Client *cl;
+static volatile size_t sink;
+static char root[] = "/tmp/httpd-micro.XXXXXX";
+static int counting;
+static unsigned long allocs;
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+static void corpus_load(const char *);
+static void setup(void);
+static void cleanup(void);
+static void client_load(const struct req *);
+static void client_done(void);
+static double bench_time(const struct bench *, double *);
+static double bench_syscalls(const struct bench *);
+
+void *
+malloc(size_t size)
+{
+	allocs += counting;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+	allocs += counting;
+	return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *p, size_t size)
+{
+	allocs += counting;
+	return __libc_realloc(p, size);
+}
+
+int
+posix_memalign(void **p, size_t align, size_t size)
+{
+	allocs += counting;
+	return (*p = __libc_memalign(align, size)) ? 0 : ENOMEM;
+}
+
+/* the libc one does not go through malloc */
+char *
+strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	allocs += counting;
+	if ((p = __libc_malloc(len)))
+		memcpy(p, s, len);
+	return p;
+}
+
+/* httpd.c is not linked, no listener counts the connections */
+void
+conn_release(struct listener *l)
+{
+	(void)l;
+}
+
+void
+conn_stats(unsigned long *shed, unsigned long *pauses)
+{
+	*shed = *pauses = 0;
+}
+
+static void
+op_splitstr(const struct req *r)
+{
+	char *s;
+	size_t n;
+
+	s = arena_strdup(&cl->mem, r->data);
+	splitstr(cl, s, "\r\n", &n);
+	sink += n;
+	arena_reset(&cl->mem, conf.arena_max);
+}
+
+static void
+op_parse(const struct req *r)
+{
+	struct http_parser hp;
+
+	memcpy(cl->rbuf, r->data, r->len);
+	http_parser_init(&hp, conf.max_request_line, conf.max_header_size);
+	sink += http_parse(&hp, cl->rbuf, r->len) + hp.nhdrs;
+}
+
+static void
+op_request(const struct req *r)
+{
+	client_load(r);
+	request_manage(cl);
+	sink += cl->oqlen;
+	client_done();
+}
+
+/* same without the content cache : the body is read and copied */
+static void
+op_request_copy(const struct req *r)
+{
+	size_t size = conf.ccache_size;
+
+	conf.ccache_size = 0;
+	op_request(r);
+	conf.ccache_size = size;
+}
+
+static void
+op_header_get(const struct req *r)
+{
+	sink += !!header_get(r->c, "Host") + !!header_get(r->c, "If-None-Match") +
+		!!header_get(r->c, "Accept-Encoding") + !!header_get(r->c, "Range");
+}
+
+static void
+op_mime(const struct req *r)
+{
+	sink += (size_t)get_mime_type(r->uri);
+}
+
+static void
+op_status(const struct req *r)
+{
+	static const int codes[] = { 200, 206, 304, 404, 403, 416, 500, 503 };
+
+	sink += (size_t)status_get(codes[r->len % 8]);
+}
+
+static void
+op_head(const struct req *r)
+{
+	cl->conn = (r->len & 1) ? CLOSE : KEEP_ALIVE;
+	head_start(cl, 200);
+	head_end(cl);
+	sink += cl->oqlen;
+	cl->oqlen = 0;
+	arena_reset(&cl->mem, conf.arena_max);
+}
+
+static void
+op_vhost(const struct req *r)
+{
+	sink += (size_t)vhost_find(conf.vc, r->host);
+}
+
+static const struct bench benches[] = {
+	{ "splitstr", op_splitstr },
+	{ "http_parse", op_parse },
+	{ "request_manage", op_request },
+	{ "request_copy", op_request_copy },
+	{ "header_get x4", op_header_get },
+	{ "get_mime_type", op_mime },
+	{ "status_get", op_status },
+	{ "head_start+end", op_head },
+	{ "vhost_find", op_vhost },
+};
+
+int
+main(int argc, char **argv)
+{
+	const struct bench *b;
+	double ns, na, ns_sys;
+
+	corpus_load(argc > 1 ? argv[1] : "corpus.txt");
+	setup();
+
+	printf("%d requests\n%-16s %10s %10s %10s\n", ncorpus, "op", "ns/op",
+			"allocs/op", "syscalls/op");
+	for (b = benches; b < benches + sizeof(benches) / sizeof(*benches); b++)
+	{
+		ns = bench_time(b, &na);
+		ns_sys = bench_syscalls(b);
+		if (ns_sys < 0)
+			printf("%-16s %10.1f %10.2f %10s\n", b->name, ns, na, "-");
+		else
+			printf("%-16s %10.1f %10.2f %10.2f\n", b->name, ns, na, ns_sys);
+	}
+
+	cleanup();
+	return 0;
+}
+
+/*
+ * paragraphs of LF lines, sent with CRLF
+ */
+static void
+corpus_load(const char *file)
+{
+	struct req *r;
+	struct http_hdr *h;
+	char line[4096], buf[16384];
+	size_t len = 0, n;
+	FILE *fp;
+	int i, eof = 0;
+
+	if (!(fp = fopen(file, "r")))
+		err(EXIT_FAILURE, "%s", file);
+
+	while (!eof)
+	{
+		if (!fgets(line, sizeof(line), fp)) {
+			eof = 1;
+			line[0] = '\n';
+			line[1] = '\0';
+		}
+		if (line[0] == '#')
+			continue;
+
+		n = strcspn(line, "\r\n");
+		if (n > 0) {
+			if (len + n + 2 >= sizeof(buf))
+				errx(EXIT_FAILURE, "%s: request too large", file);
+			memcpy(buf + len, line, n);
+			memcpy(buf + len + n, "\r\n", 2);
+			len += n + 2;
+			continue;
+		}
+		if (len == 0)
+			continue;
+		if (ncorpus == CORPUS_MAX)
+			break;
+
+		memcpy(buf + len, "\r\n", 3);
+		len += 2;
+		r = &corpus[ncorpus];
+		XMALLOC(r->data, len + 1);
+		memcpy(r->data, buf, len + 1);
+		r->len = len;
+
+		/* tokens the lookups work on */
+		XCALLOC(r->c, 1, sizeof(*r->c));
+		XMALLOC(r->c->rbuf, len + 1);
+		memcpy(r->c->rbuf, buf, len + 1);
+		http_parser_init(&r->c->hp, 0, 0);
+		if (http_parse(&r->c->hp, r->c->rbuf, len) != 1)
+			errx(EXIT_FAILURE, "%s: request %d does not parse", file,
+					ncorpus + 1);
+		r->uri = http_str(r->c->rbuf, &r->c->hp.uri);
+		r->host = "";
+		for (i = 0; i < r->c->hp.nhdrs; i++)
+		{
+			h = &r->c->hp.hdrs[i];
+			http_str(r->c->rbuf, &h->val);
+			if (!strcasecmp(http_str(r->c->rbuf, &h->key), "Host"))
+				r->host = r->c->rbuf + h->val.off;
+		}
+		ncorpus++;
+		len = 0;
+	}
+	fclose(fp);
+
+	if (ncorpus == 0)
+		errx(EXIT_FAILURE, "%s: no request", file);
+}
+
+/*
+ * a configuration with the corpus files under a temporary root
+ */
+static void
+setup(void)
+{
+	char path[PATH_MAX], cf[PATH_MAX];
+	size_t i;
+	FILE *fp;
+	int k;
+
+	if (!mkdtemp(root))
+		err(EXIT_FAILURE, "mkdtemp");
+
+	for (i = 0; i < sizeof(files) / sizeof(*files); i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		if (strchr(files[i], '/')) {
+			*strrchr(path, '/') = '\0';
+			mkdir(path, 0755);
+			snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		}
+		if (!(fp = fopen(path, "w")))
+			err(EXIT_FAILURE, "%s", path);
+		for (k = 0; k < 64; k++)
+			fprintf(fp, "%s line %d of a small static file\n", files[i], k);
+		fclose(fp);
+	}
+
+	snprintf(cf, sizeof(cf), "%s/httpd.conf", root);
+	if (!(fp = fopen(cf, "w")))
+		err(EXIT_FAILURE, "%s", cf);
+	fprintf(fp, "host localhost root %s\n"
+			"host www.example.com root %s\n"
+			"host *.example.org root %s\n"
+			"host api.example.com root %s\n"
+			"host * root %s\n"
+			"set access-log none\n"
+			"set ccache-size 1048576\n", root, root, root, root, root);
+	fclose(fp);
+
+	if (parse_config(cf, &conf) != 0)
+		exit(EXIT_FAILURE);
+
+	tmpl_init();
+	fcache_init();
+	alog_init();
+
+	cl = client_new();
+	cl->fd = -1;
+	cl->vc = conf.vc;
+	cl->rsize = 16384;
+	XMALLOC(cl->rbuf, cl->rsize);
+	client_load(&corpus[0]);
+}
+
+static void
+cleanup(void)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	for (i = 0; i < sizeof(files) / sizeof(*files); i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+		unlink(path);
+		if (strchr(files[i], '/')) {
+			*strrchr(path, '/') = '\0';
+			rmdir(path);
+		}
+	}
+	snprintf(path, sizeof(path), "%s/httpd.conf", root);
+	unlink(path);
+	rmdir(root);
+}
+
+/*
+ * a parsed request in the client, as client_handle() leaves it
+ */
+static void
+client_load(const struct req *r)
+{
+	memcpy(cl->rbuf, r->data, r->len);
+	cl->rlen = r->len;
+	cl->conn = KEEP_ALIVE;
+	http_parser_init(&cl->hp, conf.max_request_line, conf.max_header_size);
+	http_parse(&cl->hp, cl->rbuf, cl->rlen);
+	cl->body = cl->rbuf + cl->hp.pos;
+	cl->bsize = cl->rlen - cl->hp.pos;
+}
+
+/*
+ * drop the queued response as if sent
+ */
+static void
+client_done(void)
+{
+	cl->oqlen = cl->oqoff = 0;
+	cl->wlen = cl->woff = 0;
+	cl->wheld = 0;
+	client_reset(cl);
+}
+
+static double
+bench_time(const struct bench *b, double *na)
+{
+	struct timespec t0, t1;
+	int i;
+
+	/* warm the caches, the client arena and queues */
+	for (i = 0; i < ncorpus * 16; i++)
+		b->op(&corpus[i % ncorpus]);
+
+	allocs = 0;
+	counting = 1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < ITER; i++)
+		b->op(&corpus[i % ncorpus]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	counting = 0;
+
+	*na = (double)allocs / ITER;
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ITER;
+}
+
+/*
+ * system calls of SYS_ITER operations in a traced child, -1 when it
+ * cannot be traced
+ */
+static double
+bench_syscalls(const struct bench *b)
+{
+	struct ptrace_syscall_info info;
+	pid_t pid;
+	long count = 0;
+	int i, status, marks = 0;
+
+	if ((pid = fork()) == -1)
+		return -1;
+
+	if (pid == 0)
+	{
+		if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
+			_exit(1);
+		raise(SIGSTOP);
+		syscall(MARK);
+		for (i = 0; i < SYS_ITER; i++)
+			b->op(&corpus[i % ncorpus]);
+		syscall(MARK);
+		_exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status) ||
+			ptrace(PTRACE_SETOPTIONS, pid, NULL,
+				PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) == -1) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+
+	while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != -1 &&
+			waitpid(pid, &status, 0) != -1 && WIFSTOPPED(status))
+	{
+		if (WSTOPSIG(status) != (SIGTRAP | 0x80))
+			continue;
+		if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) == -1)
+			break;
+		if (info.op != PTRACE_SYSCALL_INFO_ENTRY)
+			continue;
+		if (info.entry.nr == MARK) {
+			if (++marks == 2)
+				break;
+			continue;
+		}
+		if (marks)
+			count++;
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	return (marks == 2) ? (double)count / SYS_ITER : -1;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * MIME type benchmark : mime_lookup() against the former basename +
+ * linear scan of mime_types.h, in ns per lookup
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+
+#include "../httpd/mime.h"
+
+#define ITER	1000000
+
+static struct mime m_type[] = {
+#include "../httpd/mime_types.h"
+};
+
+static const char *paths[] = {
+	"/var/www/index.html",
+	"/var/www/img/logo.png",
+	"/var/www/css/site.css",
+	"/var/www/dl/archive.zip",
+	"/var/www/README",
+	"/var/www/movie.wmv",
+};
+
+static const char *
+linear(char *path)
+{
+	size_t i;
+	char *ext;
+
+	if ((ext = basename(path)) &&
+			(ext = strrchr(ext, '.'))) {
+		ext++;
+		for (i = 0; i < sizeof(m_type) / sizeof(*m_type); i++)
+			if (!strcmp(m_type[i].ext, ext))
+				return m_type[i].type;
+	}
+
+	return "text/plain; charset=utf-8";
+}
+
+static const char *
+hashed(char *path)
+{
+	const char *ext, *type;
+
+	if ((ext = strrchr(path, '.')) && !strchr(ext, '/') &&
+			(type = mime_lookup(&mime_default, ext + 1)))
+		return type;
+
+	return "text/plain; charset=utf-8";
+}
+
+static double
+run(const char *(*lookup)(char *), const char *p)
+{
+	struct timespec t0, t1;
+	volatile size_t sink = 0;
+	char path[256];
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < ITER; i++) {
+		strcpy(path, p);
+		sink += strlen(lookup(path));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	(void)sink;
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ITER;
+}
+
+int
+main(void)
+{
+	char path[256];
+	size_t i;
+	double o, n;
+
+	printf("%-24s %10s %10s %8s\n", "path", "linear", "hashed", "speedup");
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+	{
+		strcpy(path, paths[i]);
+		if (strcmp(linear(path), hashed(path)))
+			printf("%s: lookups differ\n", paths[i]);
+
+		o = run(linear, paths[i]);
+		n = run(hashed, paths[i]);
+		printf("%-24s %8.1fns %8.1fns %7.1fx\n", paths[i], o, n, o / n);
+	}
+
+	return 0;
+}
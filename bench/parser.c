@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * request parser benchmark : http_parse() against the former
+ * memmem + splitstr + strstr(": ") path, in ns per request
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../httpd/http.h"
+
+#define ITER	200000
+
+static const char *reqs[] = {
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n",
+
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:60.0) Gecko/20100101 Firefox/60.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://www.example.com/\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=0123456789abcdef0123456789abcdef; theme=dark; lang=en\r\n"
+	"If-None-Match: \"123451234567890\"\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"\r\n",
+};
+
+/* the former path, one heap copy per line and per token */
+static char **
+splitstr(char *str, const char *sep)
+{
+	int i, size;
+	char *p, *tmp, **split;
+
+	for (i = size = 0; str[i]; i++)
+		if (str[i] == *sep)
+			size++;
+
+	size += 2;
+	split = malloc(size * sizeof(char *));
+
+	i = 0;
+	for (p = str; p;)
+		while ((tmp = strsep(&p, sep)))
+			if (*tmp) {
+				while (*tmp == ' ' || *tmp == '\t')
+					tmp++;
+				split[i++] = strdup(tmp);
+			}
+
+	split[i] = NULL;
+	return split;
+}
+
+static void
+splitfree(char **split)
+{
+	char **p;
+
+	for (p = split; *p; p++)
+		free(*p);
+	free(split);
+}
+
+static int
+legacy_parse(const char *req, size_t len)
+{
+	char *data, *end, *p, **lines, **line, **tok;
+	int n = 0;
+
+	data = malloc(len + 1);
+	memcpy(data, req, len);
+	data[len] = '\0';
+
+	if ((end = memmem(data, len, "\r\n\r\n", 4)) == NULL) {
+		free(data);
+		return -1;
+	}
+	end[2] = '\0';
+
+	lines = splitstr(data, "\r\n");
+	tok = splitstr(lines[0], " ");
+	for (line = lines + 1; *line; line++)
+		if ((p = strstr(*line, ": "))) {
+			*p = '\0';
+			n++;
+		}
+
+	splitfree(tok);
+	splitfree(lines);
+	free(data);
+	return n;
+}
+
+static int
+new_parse(const char *req, size_t len)
+{
+	struct http_parser hp;
+	char buf[4096];
+
+	/* same copy into the receive buffer as the legacy path */
+	memcpy(buf, req, len);
+	http_parser_init(&hp, 8192, 65536);
+	if (http_parse(&hp, buf, len) != 1)
+		return -1;
+	return hp.nhdrs;
+}
+
+static double
+run(int (*parse)(const char *, size_t), const char *req)
+{
+	struct timespec t0, t1;
+	size_t len = strlen(req);
+	volatile int sink = 0;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < ITER; i++)
+		sink += parse(req, len);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	(void)sink;
+	return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / ITER;
+}
+
+int
+main(void)
+{
+	size_t i;
+	double o, n;
+
+	printf("%-8s %8s %10s %10s %8s\n", "request", "bytes", "splitstr", "http_parse",
+			"speedup");
+	for (i = 0; i < sizeof(reqs) / sizeof(reqs[0]); i++)
+	{
+		o = run(legacy_parse, reqs[i]);
+		n = run(new_parse, reqs[i]);
+		printf("%-8zu %8zu %8.1fns %8.1fns %7.1fx\n", i, strlen(reqs[i]), o, n,
+				o / n);
+	}
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# load scenarios against a temporary vhost on loopback, one JSON object
+# per scenario and engine on stdout, compared with $BASELINE when set
+#
+#	make bench [DURATION=5] [BASELINE=old.json] [OUT=bench.json]
+#	    [ENGINES="epoll uring thread"]
+#
+
+HTTPD=${HTTPD:-../httpd/httpd}
+PORT=${PORT:-8089}
+DURATION=${DURATION:-5}
+OUT=${OUT:-bench.json}
+TOL=${TOL:-10}
+ENGINES=${ENGINES:-epoll uring}
+
+tmp=$(mktemp -d /tmp/httpd-bench.XXXXXX) || exit 1
+trap 'kill $pid 2>/dev/null; rm -rf $tmp' EXIT INT TERM
+
+# file size mix
+head -c 128 /dev/zero | tr '\0' a > $tmp/small.html
+head -c 4096 /dev/zero | tr '\0' b > $tmp/4k.html
+head -c 65536 /dev/urandom > $tmp/64k.bin
+head -c 1048576 /dev/urandom > $tmp/1m.bin
+
+ret=0
+run()
+{
+	name=$1-$engine
+	shift
+	./load -n $name -d $DURATION ${BASELINE:+-B $BASELINE -T $TOL} \
+		"$@" 127.0.0.1 $PORT >> $tmp/out || ret=1
+}
+
+for engine in $ENGINES; do
+	cat > $tmp/httpd.conf <<CONF
+listen on 127.0.0.1 port $PORT
+host localhost root $tmp
+set engine $engine
+set access-log none
+CONF
+
+	$HTTPD -f $tmp/httpd.conf 2>$tmp/httpd.log &
+	pid=$!
+	sleep 1
+	if ! kill -0 $pid 2>/dev/null; then
+		cat $tmp/httpd.log >&2
+		exit 1
+	fi
+
+	run keepalive-small	-c 64 -t 2 -u /small.html
+	run keepalive-mix	-c 64 -t 2 -u /small.html -u /small.html -u /4k.html \
+		-u /4k.html -u /64k.bin -u /1m.bin
+	run pipeline-16		-c 16 -t 2 -p 16 -u /small.html -u /4k.html
+	run close-small		-c 32 -t 2 -k -u /small.html
+	run not-found		-c 64 -t 2 -u /missing.html
+	run large		-c 16 -t 2 -u /1m.bin
+
+	kill $pid
+	wait $pid 2>/dev/null
+done
+
+{
+	echo "["
+	sed '$!s/$/,/' $tmp/out
+	echo "]"
+} | tee $OUT
+
+exit $ret
@@ -0,0 +1,657 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Access log : serving threads copy the raw fields of each request in a
+ * ring of their own (single producer, single consumer, no lock) and one
+ * writer thread formats them and appends them to the log files with a
+ * write(2) per file and batch. A full ring drops the entry and counts
+ * it, a request never waits for the disk.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/param.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "alog.h"
+
+#define ALOG_HDRS		8		/* %{Header}i of a format */
+#define ALOG_FIELD_MAX	4096	/* longer strings are cut */
+#define ALOG_OUT		65536	/* writer buffer of a file */
+#define ALOG_IDLE		10000	/* writer sleep when idle, usec */
+
+/* an open log file, shared by the vhosts logging to it */
+struct alog_file {
+	char				*path;		/* NULL for stderr */
+	int					fd;
+	char				*buf;		/* formatted entries */
+	size_t				len;
+	struct alog_file	*next;
+};
+
+enum { OP_TEXT, OP_ADDR, OP_TIME, OP_REQUEST, OP_METHOD, OP_URI,
+	OP_PROTO, OP_STATUS, OP_BYTES, OP_HOST, OP_HEADER };
+
+struct alog_op {
+	int			type;
+	const char	*text;			/* OP_TEXT */
+	size_t		len;
+	int			hdr;			/* OP_HEADER : index in the record */
+};
+
+/* a compiled format and where it goes */
+struct alog {
+	struct alog_file	*file;
+	const char			*path;		/* the one of file */
+	char				*format;
+	struct alog_op		*ops;
+	int					nops;
+	char				*hdrs[ALOG_HDRS];	/* names of OP_HEADER */
+	size_t				hlen[ALOG_HDRS];
+	int					nhdrs;
+	struct alog			*next;
+};
+
+/* raw request fields, followed by NUL terminated strings */
+struct alog_rec {
+	uint32_t				len;	/* whole record, 0 : wrap to the start */
+	int						code;
+	const struct alog		*log;
+	time_t					t;
+	unsigned long			bytes;
+	struct sockaddr_storage	ss;
+	char					strs[];	/* host, method, uri, version, headers */
+};
+
+#define REC_STRS	4
+
+struct alog_ring {
+	char				*data;
+	size_t				size;		/* power of 2 */
+	size_t				head;		/* written by the owner */
+	char				pad[64];	/* keep head and tail apart */
+	size_t				tail;		/* read by the writer */
+	unsigned long		drops;
+	struct alog_ring	*next;		/* every ring, for the writer */
+	struct alog_ring	*fnext;		/* rings of exited threads */
+};
+
+static struct alog *logs;
+static struct alog *deflog;			/* requests without a vhost */
+static struct alog_file *files;
+static struct alog_ring *rings;
+static struct alog_ring *pool;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static int reopen;
+static int started;
+
+static int alog_get(const char *, const char *, struct alog **);
+static void alog_start(void);
+static int alog_compile(struct alog *);
+static struct alog_ring *ring_get(void);
+static void ring_put(void *);
+static void *alog_main(void *);
+static size_t alog_drain(struct alog_ring *);
+static void alog_format(const struct alog_rec *);
+static void alog_files_reopen(void);
+static void out(struct alog_file *, const char *, size_t);
+static void outq(struct alog_file *, const char *);
+static void out_flush(struct alog_file *);
+
+/*
+ * compile the formats, open the files and start the writer
+ */
+void
+alog_init(void)
+{
+	if (alog_get(conf.logfile, conf.logfmt, &deflog) == -1 ||
+			alog_vhosts(conf.vc) == -1)
+		exit(EXIT_FAILURE);
+}
+
+/*
+ * logs of the vhosts of vc, -1 if one cannot be used. Called before
+ * vc is published, formats and files are kept for good.
+ */
+int
+alog_vhosts(struct vconf *vc)
+{
+	struct vhost *vh;
+
+	TAILQ_FOREACH(vh, &vc->vhosts, entry)
+		if (alog_get(vh->logfile ? vh->logfile : conf.logfile,
+					vh->logfmt ? vh->logfmt : conf.logfmt, &vh->log) == -1)
+			return -1;
+
+	alog_start();
+	return 0;
+}
+
+/*
+ * the writer, once there is a log
+ */
+static void
+alog_start(void)
+{
+	pthread_t tid;
+
+	if (started || !logs)
+		return;
+
+	if (pthread_key_create(&ring_key, ring_put) != 0)
+		err(EXIT_FAILURE, "pthread_key_create");
+
+	if (pthread_create(&tid, NULL, alog_main, NULL) != 0)
+		err(EXIT_FAILURE, "pthread_create");
+	started = 1;
+}
+
+/*
+ * the log for path and format in *lp, NULL if path is "none"
+ */
+static int
+alog_get(const char *path, const char *format, struct alog **lp)
+{
+	struct alog *l;
+	struct alog_file *f;
+	int i;
+
+	*lp = NULL;
+	if (path && !strcmp(path, "none"))
+		return 0;
+
+	for (l = logs; l; l = l->next)
+		if (!strcmp(l->format, format) &&
+				(l->path == path || (l->path && path && !strcmp(l->path, path)))) {
+			*lp = l;
+			return 0;
+		}
+
+	for (f = files; f; f = f->next)
+		if (f->path == path || (f->path && path && !strcmp(f->path, path)))
+			break;
+	if (!f) {
+		XCALLOC(f, 1, sizeof(*f));
+		f->fd = STDERR_FILENO;
+		if (path && (f->fd = open(path, O_WRONLY | O_APPEND | O_CREAT |
+						O_CLOEXEC, 0644)) == -1) {
+			warn("%s", path);
+			free(f);
+			return -1;
+		}
+		if (path)
+			XSTRDUP(f->path, path);
+		XMALLOC(f->buf, ALOG_OUT);
+		f->next = files;
+
+		/* the writer walks them unlocked */
+		__atomic_store_n(&files, f, __ATOMIC_RELEASE);
+	}
+
+	XCALLOC(l, 1, sizeof(*l));
+	XSTRDUP(l->format, format);
+	if (alog_compile(l) == -1) {
+		warnx("log format \"%s\" is invalid", format);
+		for (i = 0; i < l->nhdrs; i++)
+			free(l->hdrs[i]);
+		free(l->ops);
+		free(l->format);
+		free(l);
+		return -1;
+	}
+
+	l->file = f;
+	l->path = f->path;
+
+	l->next = logs;
+	logs = l;
+	*lp = l;
+	return 0;
+}
+
+/*
+ * %h address, %t time, %r request line, %m method, %U uri, %H protocol,
+ * %s status, %b response bytes, %v vhost, %{Name}i request header, %%
+ */
+static int
+alog_compile(struct alog *l)
+{
+	const char *p = l->format, *end;
+	struct alog_op *op;
+
+	XCALLOC(l->ops, 2 * strlen(p) + 1, sizeof(*op));
+
+	while (*p)
+	{
+		op = &l->ops[l->nops++];
+
+		if (*p != '%' || p[1] == '%') {
+			op->type = OP_TEXT;
+			op->text = p;
+			op->len = (*p == '%') ? 1 : strcspn(p, "%");
+			p += (*p == '%') ? 2 : op->len;
+			continue;
+		}
+
+		switch (*++p) {
+			case 'h': op->type = OP_ADDR; break;
+			case 't': op->type = OP_TIME; break;
+			case 'r': op->type = OP_REQUEST; break;
+			case 'm': op->type = OP_METHOD; break;
+			case 'U': op->type = OP_URI; break;
+			case 'H': op->type = OP_PROTO; break;
+			case 's': op->type = OP_STATUS; break;
+			case 'b': op->type = OP_BYTES; break;
+			case 'v': op->type = OP_HOST; break;
+			case '{':
+				if (!(end = strchr(p, '}')) || end[1] != 'i' ||
+						end == p + 1 || l->nhdrs == ALOG_HDRS)
+					return -1;
+				op->type = OP_HEADER;
+				op->hdr = l->nhdrs;
+				l->hlen[l->nhdrs] = end - p - 1;
+				XCALLOC(l->hdrs[l->nhdrs], l->hlen[l->nhdrs] + 1, 1);
+				memcpy(l->hdrs[l->nhdrs], p + 1, l->hlen[l->nhdrs]);
+				l->nhdrs++;
+				p = end + 1;
+				break;
+			default:
+				return -1;
+		}
+		p++;
+	}
+
+	return 0;
+}
+
+/*
+ * queue the entry of the request c has just answered
+ */
+void
+alog_request(struct Client *c)
+{
+	const struct alog *l = c->vh ? c->vh->log : deflog;
+	struct alog_ring *r;
+	struct alog_rec *rec;
+	struct http_hdr *h;
+	const char *s[REC_STRS + ALOG_HDRS];
+	size_t n[REC_STRS + ALOG_HDRS];
+	size_t need, head, tail, pos, room;
+	char *p;
+	int i, j, ns;
+
+	if (!l || !(r = ring_get()))
+		return;
+
+	s[0] = c->vh ? c->vh->host : NULL;
+	s[1] = c->smethod;
+	s[2] = c->uri;
+	s[3] = c->sversion;
+	ns = REC_STRS;
+	need = offsetof(struct alog_rec, strs);
+	for (i = 0; i < ns; i++) {
+		n[i] = s[i] ? MIN(strlen(s[i]), ALOG_FIELD_MAX) : 0;
+		need += n[i] + 1;
+	}
+
+	/* headers may not be NUL terminated yet on errors */
+	for (j = 0; j < l->nhdrs; j++, ns++)
+	{
+		s[ns] = NULL;
+		n[ns] = 0;
+		for (i = 0; i < c->hp.nhdrs; i++)
+		{
+			h = &c->hp.hdrs[i];
+			if (h->key.len == l->hlen[j] &&
+					!strncasecmp(c->rbuf + h->key.off, l->hdrs[j], h->key.len)) {
+				s[ns] = c->rbuf + h->val.off;
+				n[ns] = MIN(h->val.len, ALOG_FIELD_MAX);
+				break;
+			}
+		}
+		need += n[ns] + 1;
+	}
+	need = (need + 7) & ~(size_t)7;
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	pos = head & (r->size - 1);
+
+	/* records are contiguous, wrap with a 0 length marker */
+	room = r->size - pos;
+	if (need > room) {
+		if (head + room + need - tail > r->size)
+			goto drop;
+		*(uint32_t *)(r->data + pos) = 0;
+		head += room;
+		pos = 0;
+	}
+	else if (head + need - tail > r->size)
+		goto drop;
+
+	rec = (struct alog_rec *)(r->data + pos);
+	rec->len = need;
+	rec->code = c->code;
+	rec->log = l;
+	rec->t = time(NULL);
+	rec->bytes = c->obytes;
+	memcpy(&rec->ss, &c->ss, sizeof(rec->ss));
+	for (p = rec->strs, i = 0; i < ns; i++) {
+		memcpy(p, s[i] ? s[i] : "", n[i]);
+		p[n[i]] = '\0';
+		p += n[i] + 1;
+	}
+
+	__atomic_store_n(&r->head, head + need, __ATOMIC_RELEASE);
+	return;
+
+drop:
+	__atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * ask the writer to reopen the files (rotation)
+ */
+void
+alog_reopen(void)
+{
+	__atomic_store_n(&reopen, 1, __ATOMIC_RELEASE);
+}
+
+unsigned long
+alog_dropped(void)
+{
+	struct alog_ring *r;
+	unsigned long n = 0;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+		n += __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+
+	return n;
+}
+
+/*
+ * ring of the calling thread, one of an exited thread if any
+ */
+static struct alog_ring *
+ring_get(void)
+{
+	struct alog_ring *r;
+
+	if ((r = pthread_getspecific(ring_key)))
+		return r;
+
+	pthread_mutex_lock(&pool_mtx);
+	if ((r = pool))
+		pool = r->fnext;
+	pthread_mutex_unlock(&pool_mtx);
+
+	if (!r) {
+		XCALLOC(r, 1, sizeof(*r));
+		for (r->size = 4096; r->size < conf.log_buffer; r->size <<= 1)
+			;
+		XMALLOC(r->data, r->size);
+
+		/* rings are never freed, the writer walks them unlocked */
+		pthread_mutex_lock(&pool_mtx);
+		r->next = rings;
+		__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&pool_mtx);
+	}
+
+	pthread_setspecific(ring_key, r);
+	return r;
+}
+
+/*
+ * thread exit : the writer still drains the ring, the next thread
+ * to log fills it
+ */
+static void
+ring_put(void *arg)
+{
+	struct alog_ring *r = arg;
+
+	pthread_mutex_lock(&pool_mtx);
+	r->fnext = pool;
+	pool = r;
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+static void *
+alog_main(void *arg)
+{
+	struct alog_ring *r;
+	struct alog_file *f;
+	unsigned long drops, reported = 0;
+	size_t n;
+
+	(void)arg;
+	pthread_detach(pthread_self());
+
+	for (;;)
+	{
+		if (__atomic_exchange_n(&reopen, 0, __ATOMIC_ACQUIRE))
+			alog_files_reopen();
+
+		n = 0;
+		for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+			n += alog_drain(r);
+		for (f = __atomic_load_n(&files, __ATOMIC_ACQUIRE); f; f = f->next)
+			out_flush(f);
+
+		if ((drops = alog_dropped()) != reported) {
+			warnx("access log: %lu entries dropped", drops - reported);
+			reported = drops;
+		}
+
+		if (n == 0)
+			usleep(ALOG_IDLE);
+	}
+
+	return NULL;
+}
+
+/*
+ * format the entries of r, return their number
+ */
+static size_t
+alog_drain(struct alog_ring *r)
+{
+	const struct alog_rec *rec;
+	size_t head, tail, pos, n = 0;
+
+	tail = r->tail;
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	while (tail != head)
+	{
+		pos = tail & (r->size - 1);
+		rec = (const struct alog_rec *)(r->data + pos);
+		if (rec->len == 0) {
+			tail += r->size - pos;
+			continue;
+		}
+		alog_format(rec);
+		tail += rec->len;
+		n++;
+	}
+
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void
+alog_format(const struct alog_rec *rec)
+{
+	static time_t last = -1;
+	static char date[32];
+	const struct alog *l = rec->log;
+	struct alog_file *f = l->file;
+	const char *s[REC_STRS + ALOG_HDRS];
+	char buf[INET6_ADDRSTRLEN + 32];
+	struct tm tm;
+	const char *p;
+	int i;
+
+	for (p = rec->strs, i = 0; i < REC_STRS + l->nhdrs; i++) {
+		s[i] = p;
+		p += strlen(p) + 1;
+	}
+
+	for (i = 0; i < l->nops; i++)
+	{
+		switch (l->ops[i].type) {
+			case OP_TEXT:
+				out(f, l->ops[i].text, l->ops[i].len);
+				break;
+			case OP_ADDR:
+				get_ipstring((struct sockaddr_storage *)&rec->ss, buf);
+				out(f, buf, strlen(buf));
+				break;
+			case OP_TIME:
+				if (rec->t != last) {
+					localtime_r(&rec->t, &tm);
+					strftime(date, sizeof(date), "[%d/%b/%Y:%H:%M:%S %z]", &tm);
+					last = rec->t;
+				}
+				out(f, date, strlen(date));
+				break;
+			case OP_REQUEST:
+				outq(f, s[1]);
+				out(f, " ", 1);
+				outq(f, s[2]);
+				out(f, " ", 1);
+				outq(f, s[3]);
+				break;
+			case OP_METHOD:
+			case OP_URI:
+			case OP_PROTO:
+				outq(f, s[l->ops[i].type - OP_METHOD + 1]);
+				break;
+			case OP_HOST:
+				outq(f, s[0]);
+				break;
+			case OP_HEADER:
+				outq(f, s[REC_STRS + l->ops[i].hdr]);
+				break;
+			case OP_STATUS:
+				snprintf(buf, sizeof(buf), "%d", rec->code);
+				out(f, buf, strlen(buf));
+				break;
+			case OP_BYTES:
+				snprintf(buf, sizeof(buf), "%lu", rec->bytes);
+				out(f, buf, strlen(buf));
+				break;
+		}
+	}
+	out(f, "\n", 1);
+}
+
+/*
+ * SIGUSR1 : reopen the files moved away, keep the old descriptor if
+ * the new one cannot be opened
+ */
+static void
+alog_files_reopen(void)
+{
+	struct alog_file *f;
+	int fd;
+
+	for (f = __atomic_load_n(&files, __ATOMIC_ACQUIRE); f; f = f->next)
+	{
+		if (!f->path)
+			continue;
+		out_flush(f);
+		if ((fd = open(f->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+						0644)) == -1) {
+			warn("%s", f->path);
+			continue;
+		}
+		close(f->fd);
+		f->fd = fd;
+	}
+}
+
+static void
+out(struct alog_file *f, const char *s, size_t len)
+{
+	if (f->len + len > ALOG_OUT)
+		out_flush(f);
+	if (len > ALOG_OUT)
+		len = ALOG_OUT;
+	memcpy(f->buf + f->len, s, len);
+	f->len += len;
+}
+
+/*
+ * client supplied string, "-" if empty and control characters, quotes
+ * and backslashes escaped so a line is always one entry
+ */
+static void
+outq(struct alog_file *f, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[4] = { '\\', 'x', 0, 0 };
+	const unsigned char *p;
+	size_t n;
+
+	if (*s == '\0') {
+		out(f, "-", 1);
+		return;
+	}
+
+	for (p = (const unsigned char *)s; *p; p += n)
+	{
+		for (n = 0; p[n] >= 0x20 && p[n] < 0x7f && p[n] != '"' &&
+				p[n] != '\\'; n++)
+			;
+		if (n > 0) {
+			out(f, (const char *)p, n);
+			continue;
+		}
+		esc[2] = hex[*p >> 4];
+		esc[3] = hex[*p & 0xf];
+		out(f, esc, 4);
+		n = 1;
+	}
+}
+
+static void
+out_flush(struct alog_file *f)
+{
+	ssize_t n;
+	size_t off = 0;
+
+	while (off < f->len)
+	{
+		if ((n = write(f->fd, f->buf + off, f->len - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += n;
+	}
+	f->len = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef H_ALOG
+#define H_ALOG
+
+struct Client;
+struct vconf;
+
+void alog_init(void);
+int alog_vhosts(struct vconf *);
+void alog_request(struct Client *);
+void alog_reopen(void);
+unsigned long alog_dropped(void);
+
+#endif /* H_ALOG */
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "arena.h"
+
+#define ALIGN(n)	(((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static struct ablock *
+ablock_new(size_t size)
+{
+	struct ablock *b;
+
+	if (!(b = malloc(sizeof(*b) + size)))
+		err(EXIT_FAILURE, "malloc");
+	b->next = NULL;
+	b->size = size;
+	b->used = 0;
+
+	return b;
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct ablock *b;
+
+	size = ALIGN(size ? size : 1);
+
+	/* too big for a block, keep it aside until the next reset */
+	if (size > ARENA_BLOCK / 2) {
+		b = ablock_new(size);
+		b->next = a->big;
+		a->big = b;
+		return b->data;
+	}
+
+	/* blocks kept from a previous reset are reused in order */
+	while (a->cur && a->cur->size - a->cur->used < size && a->cur->next)
+		a->cur = a->cur->next;
+
+	if (!a->cur || a->cur->size - a->cur->used < size)
+	{
+		b = ablock_new(ARENA_BLOCK);
+		a->total += b->size;
+		if (a->cur)
+			a->cur->next = b;
+		else
+			a->head = b;
+		a->cur = b;
+	}
+
+	b = a->cur;
+	b->used += size;
+
+	return b->data + b->used - size;
+}
+
+void *
+arena_calloc(struct arena *a, size_t n, size_t size)
+{
+	void *p;
+
+	p = arena_alloc(a, n * size);
+	memset(p, 0, n * size);
+
+	return p;
+}
+
+char *
+arena_strdup(struct arena *a, const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(arena_alloc(a, len), s, len);
+}
+
+/*
+ * format in the free space of the current block, allocate only when
+ * it does not fit
+ */
+int
+arena_vasprintf(struct arena *a, char **ptr, const char *fmt, va_list ap)
+{
+	va_list aq;
+	size_t avail = 0;
+	char *p = NULL;
+	int n;
+
+	if (a->cur) {
+		avail = a->cur->size - a->cur->used;
+		p = a->cur->data + a->cur->used;
+	}
+
+	va_copy(aq, ap);
+	n = vsnprintf(p, avail, fmt, aq);
+	va_end(aq);
+
+	if (n < 0) {
+		*ptr = NULL;
+		return n;
+	}
+
+	/* claim the formatted bytes, they are at the current position */
+	if ((size_t)n < avail && ALIGN(n + 1) <= ARENA_BLOCK / 2)
+		*ptr = arena_alloc(a, n + 1);
+	else
+		vsnprintf(*ptr = arena_alloc(a, n + 1), n + 1, fmt, ap);
+
+	return n;
+}
+
+/*
+ * release everything, keep at most max bytes of blocks for reuse
+ */
+void
+arena_reset(struct arena *a, size_t max)
+{
+	struct ablock *b, **bp;
+	size_t kept = 0;
+
+	while ((b = a->big)) {
+		a->big = b->next;
+		free(b);
+	}
+
+	for (bp = &a->head; (b = *bp);)
+	{
+		if (kept + b->size > max) {
+			*bp = b->next;
+			a->total -= b->size;
+			free(b);
+			continue;
+		}
+		kept += b->size;
+		b->used = 0;
+		bp = &b->next;
+	}
+
+	a->cur = a->head;
+}
+
+void
+arena_free(struct arena *a)
+{
+	arena_reset(a, 0);
+}
@@ -0,0 +1,35 @@
+#ifndef H_ARENA
+#define H_ARENA
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#define ARENA_BLOCK	4096	/* default block size */
+#define ARENA_ALIGN	16
+
+/*
+ * bump pointer allocator, everything is released at once by
+ * arena_reset() or arena_free()
+ */
+struct ablock {
+	struct ablock	*next;
+	size_t			size;	/* usable bytes */
+	size_t			used;
+	char			data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+	struct ablock	*head;	/* first block */
+	struct ablock	*cur;	/* block being filled */
+	struct ablock	*big;	/* oversized allocations */
+	size_t			total;	/* bytes held by blocks */
+};
+
+void *arena_alloc(struct arena *, size_t);
+void *arena_calloc(struct arena *, size_t, size_t);
+char *arena_strdup(struct arena *, const char *);
+int arena_vasprintf(struct arena *, char **, const char *, va_list);
+void arena_reset(struct arena *, size_t);
+void arena_free(struct arena *);
+
+#endif /* H_ARENA */
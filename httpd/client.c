@@ -15,35 +15,74 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <sys/param.h>
+#include <limits.h>
+#if defined (__linux__)
+#include <sys/sendfile.h>
+#endif
 
 #include "httpd.h"
 #include "client.h"
+#include "fcache.h"
+#include "tmpl.h"
+#include "alog.h"
+#include "metrics.h"
+
+/* content cache response headers */
+#define BLOB_HEADERS "HTTP/1.1 200 OK\r\nServer: %s\r\n%s%s"
+
+/* output segments queued before pipelined responses stop being batched */
+#define OQ_BATCH	256
+
+#ifndef IOV_MAX
+#define IOV_MAX		1024
+#endif
+
+#ifndef MSG_MORE
+#define MSG_MORE	0
+#endif
+
+/* ranges of a request served, more and the whole file is sent */
+#define RANGE_MAX	16
 
 #define INTERNAL_SERVER_ERROR "HTTP/1.1 500 Internal Server Error\r\n" \
 	"Connection: close\r\n\r\n"
 
+static int client_flush(struct Client *c);
+static void client_reset(struct Client *c);
+static void client_hold(struct Client *c);
+static void client_unhold(struct Client *c);
+static void wbuf_reserve(struct Client *c, size_t len);
+static ssize_t body_copy(struct Client *c);
+#if defined (__linux__)
+static ssize_t body_sendfile(struct Client *c);
+static ssize_t body_splice(struct Client *c);
+#endif
 static void send_error(struct Client *c);
 static void send_uri(struct Client *c);
-static void header_send(struct Client *c);
-static void header_set(struct Client *c, const char *key, const char *fmt, ...);
+static void body_prepare(struct Client *c, off_t off, off_t len);
+static int accept_encoding(struct Client *c);
+static int not_modified(struct Client *c, struct fcentry *e);
+static int etag_match(const char *list, const char *etag);
+static int range_if(struct Client *c, struct fcentry *e);
+static int range_parse(struct Client *c, const char *spec, off_t size,
+		struct brange **out);
+static void send_range(struct Client *c, struct fcentry *e, const char *spec);
+static void send_error_hdr(struct Client *c, const char *hdr);
+static int send_blob(struct Client *c, struct fcentry *e);
 static char *header_get(struct Client *c, const char *key);
-static char *status_get(int code);
-
-static struct st_code {
-	int code;
-	char *msg;
-} status_code[] = {
-#include "status_code.h"
-};
-
-extern pthread_mutex_t httpd_mtx;
+static void head_start(struct Client *c, int code);
+static void head_end(struct Client *c);
 
 
 struct Client *
@@ -54,7 +93,10 @@ client_new(void)
 	if ((c = calloc(1, sizeof(*c))) == NULL)
 		err(1, "calloc");
 
+	c->ev = EV_CLIENT;
 	c->f = -1;
+	http_parser_init(&c->hp, conf.max_request_line, conf.max_header_size);
+	c->pipe[0] = c->pipe[1] = -1;
 
 	return c;
 }
@@ -62,185 +104,529 @@ client_new(void)
 void
 client_destroy(struct Client *c)
 {
-	Stack *el;
-	char ip[INET6_ADDRSTRLEN];
-
-	/* print stats */
-	warnx("stats for %s : 1 socket for %d requests",
-			get_ipstring(&c->ss, ip), c->count);
-
 	pthread_mutex_lock(&httpd_mtx);
 
 	/* close client socket */
 	close(c->fd);
 
-	/* close client fd */
-	if (c->f != -1)
-		close(c->f);
+	/* the file descriptor belongs to the cache entry */
+	client_hold(c);
+	client_unhold(c);
 
-	/* empty memory stack */
-	while(!SLIST_EMPTY(&c->mstack))
-	{
-		el = SLIST_FIRST(&c->mstack);
-		SLIST_REMOVE_HEAD(&c->mstack, next);
-		free(el->adr);
-		free(el);
+	if (c->pipe[0] != -1) {
+		close(c->pipe[0]);
+		close(c->pipe[1]);
 	}
 
 	/* delete client from client list */
 	SLIST_REMOVE(&clients, c, Client, next);
 
-	conf.cur_conn -= 1;
-
 	pthread_mutex_unlock(&httpd_mtx);
 
-	pthread_exit(NULL);
+	conn_release(c->l);
+
+	metrics_close(c);
+	vconf_put(c->vc);
+
+	arena_free(&c->mem);
+	free(c->rbuf);
+	free(c->oq);
+	free(c->hold);
+	free(c->wbuf);
+	free(c);
 }
 
 /*
- * push ptr address into the memory stack of the
- * current client
+ * Drive the connection as far as the socket allows : read a request,
+ * answer it, flush the response and loop for keep-alive.
+ * Return -1 when the connection must be closed, 1 when the socket
+ * would block (or timed out on a blocking socket).
  */
-void
-mstack_push(struct Client *c, void *ptr)
+int
+client_handle(struct Client *c)
 {
-	Stack *el;
+	ssize_t n;
+	int ret;
+
+	for (;;)
+	{
+		if (c->state == CL_WRITE)
+		{
+			/*
+			 * pipelined request behind a response without file body,
+			 * answer it before sending anything
+			 */
+			if (c->remain == 0 && c->wlen == 0 && c->rcur == c->nranges &&
+					c->bsize > 0 && c->conn != CLOSE && c->oqlen < OQ_BATCH) {
+				metrics_done(c);
+				client_reset(c);
+				continue;
+			}
+			if ((ret = client_flush(c)) != 0)
+				return ret;
+			metrics_done(c);
+			if (c->conn == CLOSE)
+				return -1;
+			client_reset(c);
+			continue;
+		}
+
+		/* only the new bytes are parsed */
+		if (http_parse(&c->hp, c->rbuf, c->rlen) != 0)
+		{
+			c->body = c->rbuf + c->hp.pos;
+			c->bsize = c->rlen - c->hp.pos;
+			metrics_start(c);
+			request_manage(c);
+			c->state = CL_WRITE;
+			continue;
+		}
+
+		/* no complete request left, send the batched responses */
+		if (c->oqlen > 0)
+		{
+			if ((ret = client_flush(c)) != 0)
+				return ret;
+			client_unhold(c);
+			arena_reset(&c->mem, conf.arena_max);
+		}
+
+		/* input pushed by the uring engine */
+		if (c->feed)
+			return (c->feed == -1) ? -1 : 1;
+
+		if (c->rsize - c->rlen < BUFSIZ) {
+			c->rsize += BUFSIZ;
+			XREALLOC(c->rbuf, c->rsize);
+		}
+
+		n = read(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+		c->nsys++;
+
+		if (n == 0)
+			return -1;
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 1 : -1;
+		}
 
-	if (c && ptr) {
-		XMALLOC(el, sizeof(*el));
-		el->adr = ptr;
-		SLIST_INSERT_HEAD(&c->mstack, el, next);
+		c->rlen += n;
 	}
 }
 
+/*
+ * Queue data for the client, it is sent by client_flush() and must
+ * stay valid until then : request arena or held cache memory
+ */
+void
+client_write(struct Client *c, const void *data, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	client_writev(c, &iov, 1);
+}
+
+void
+client_writev(struct Client *c, const struct iovec *iov, int cnt)
+{
+	int i;
+
+	if (c->oqlen + cnt > c->oqsize) {
+		c->oqsize = MAX(c->oqsize * 2, c->oqlen + cnt + 16);
+		XREALLOC(c->oq, c->oqsize * sizeof(*c->oq));
+	}
+
+	for (i = 0; i < cnt; i++)
+		if (iov[i].iov_len > 0) {
+			c->oq[c->oqlen++] = iov[i];
+			c->obytes += iov[i].iov_len;
+		}
+}
 
 /*
- * Read request and send a response
+ * Append received input, behind the unanswered requests when a
+ * response is pending
  */
 void
-request_manage(struct Client *c)
+client_feed(struct Client *c, const void *data, size_t len)
+{
+	size_t off;
+
+	if (c->rsize - c->rlen < len) {
+		off = c->body ? (char *)c->body - c->rbuf : 0;
+		c->rsize = c->rlen + MAX(len, BUFSIZ);
+		XREALLOC(c->rbuf, c->rsize);
+		if (c->body)
+			c->body = c->rbuf + off;
+	}
+
+	memcpy(c->rbuf + c->rlen, data, len);
+	c->rlen += len;
+	if (c->body)
+		c->bsize += len;
+}
+
+static void
+wbuf_reserve(struct Client *c, size_t len)
 {
-	char buf[BUFSIZ];
-	void *data = NULL;
+	if (c->wsize - c->wlen >= len)
+		return;
+
+	c->wsize = c->wlen + MAX(len, BUFSIZ);
+	XREALLOC(c->wbuf, c->wsize);
+}
+
+/*
+ * Send pending output then the remaining file body.
+ * Return 0 when the response is complete, 1 if the socket would
+ * block, -1 on error
+ */
+static int
+client_flush(struct Client *c)
+{
+	struct msghdr msg;
+	struct brange *r;
+	unsigned long obytes;
 	ssize_t n;
-	size_t nread = 0;
-	off_t offset = 0;
-	char **hdrs, **line;
-	size_t hdrs_size, i;
-	struct http_hdrs *hel; /* header element */
-	char *conn;
-	char ip[INET6_ADDRSTRLEN];
 
-	if (c->bsize != 0) {
-		XMALLOC(data, c->bsize);
-		memcpy(data, c->body, c->bsize);
-		nread = c->bsize;
-	}
+	memset(&msg, 0, sizeof(msg));
 
-	for(;;)
+	for (;;)
 	{
-		if ((c->body = memmem(data+offset, nread-offset, "\r\n\r\n", 4))) {
-			*(char*)c->body = '\0';
-			c->body += 4;
-			c->bsize = data + nread - c->body;
-			break;
+		/*
+		 * the queued responses, in as few calls as possible, a file
+		 * body follows in the same segment
+		 */
+		if (c->oqoff < c->oqlen)
+		{
+			msg.msg_iov = c->oq + c->oqoff;
+			msg.msg_iovlen = MIN(c->oqlen - c->oqoff, IOV_MAX);
+			n = sendmsg(c->fd, &msg, (c->remain > 0) ? MSG_MORE : 0);
+			c->nsys++;
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				return -1;
+			}
+			c->sent += n;
+			while (n > 0) {
+				if ((size_t)n >= c->oq[c->oqoff].iov_len) {
+					n -= c->oq[c->oqoff].iov_len;
+					c->oqoff++;
+					continue;
+				}
+				c->oq[c->oqoff].iov_base = (char *)c->oq[c->oqoff].iov_base + n;
+				c->oq[c->oqoff].iov_len -= n;
+				n = 0;
+			}
+			continue;
 		}
 
-		n = read(c->fd, buf, BUFSIZ);
+		c->oqoff = c->oqlen = 0;
+		c->wheld = 0;
 
-		if (n == -1 || n == 0)
+		if (c->woff < c->wlen)
 		{
-			if (data)
-				mstack_push(c, data);
-			client_destroy(c);
-			break;
+			n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+			c->nsys++;
+			if (n == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				return -1;
+			}
+			c->woff += n;
+			c->sent += n;
+			continue;
 		}
 
-		nread += n;
+		c->woff = c->wlen = 0;
+
+		/* next part of a multipart body */
+		if (c->remain == 0)
+		{
+			if (c->rcur == c->nranges)
+				return 0;
+			r = &c->ranges[c->rcur++];
+			/* already counted with the whole body by send_range() */
+			obytes = c->obytes;
+			client_write(c, r->head, r->hlen);
+			if (r->len > 0)
+				body_prepare(c, r->start, r->len);
+			c->obytes = obytes;
+			continue;
+		}
+
+		switch (c->bmode) {
+#if defined (__linux__)
+			case BODY_SENDFILE:
+				n = body_sendfile(c);
+				break;
+			case BODY_SPLICE:
+				n = body_splice(c);
+				break;
+#endif
+			default:
+				n = body_copy(c);
+				break;
+		}
 
-		XREALLOC(data, nread);
-		memcpy(data+nread-n, buf, n);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+	}
+}
 
-		offset = (nread-n-4 > 0) ? nread-n-4 : 0;
+/*
+ * small files : refill wbuf from the file, a short file breaks
+ * Content-Length
+ */
+static ssize_t
+body_copy(struct Client *c)
+{
+	ssize_t n;
 
+	wbuf_reserve(c, BUFSIZ);
+	n = pread(c->f, c->wbuf, MIN(BUFSIZ, c->remain), c->offset);
+	c->nsys++;
+	if (n <= 0) {
+		errno = (n == 0) ? EIO : errno;
+		return -1;
 	}
 
-	mstack_push(c, data);
+	c->offset += n;
+	c->wlen = n;
+	c->remain -= n;
 
-	/* parse request */
+	return n;
+}
+
+#if defined (__linux__)
+/*
+ * zero copy from the page cache to the socket, by chunks so an event
+ * loop is not held by one large file
+ */
+static ssize_t
+body_sendfile(struct Client *c)
+{
+	ssize_t n;
+
+	n = sendfile(c->fd, c->f, &c->offset,
+			MIN((off_t)conf.sendfile_chunk, c->remain));
+	c->nsys++;
+
+	if (n == 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (n == -1) {
+		/* sendfile(2) not supported for this file, try splice(2) */
+		if (errno == EINVAL || errno == ENOSYS) {
+			c->bmode = BODY_SPLICE;
+			errno = EINTR;
+		}
+		return -1;
+	}
+
+	c->remain -= n;
+	c->sent += n;
+
+	return n;
+}
+
+/*
+ * file -> pipe -> socket, c->piped bytes wait in the pipe
+ */
+static ssize_t
+body_splice(struct Client *c)
+{
+	ssize_t n;
+
+	if (c->pipe[0] == -1 && pipe2(c->pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+		return -1;
+
+	if (c->piped == 0)
+	{
+		n = splice(c->f, &c->offset, c->pipe[1], NULL,
+				MIN((off_t)conf.sendfile_chunk, c->remain),
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		c->nsys++;
+		if (n <= 0) {
+			/* not even splice, fall back to read/write */
+			if (n == -1 && errno == EINVAL) {
+				c->bmode = BODY_COPY;
+				errno = EINTR;
+			}
+			else if (n == 0)
+				errno = EIO;
+			return -1;
+		}
+		c->piped = n;
+	}
+
+	n = splice(c->pipe[0], NULL, c->fd, NULL, c->piped,
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+	c->nsys++;
+	if (n <= 0) {
+		errno = (n == 0) ? EIO : errno;
+		return -1;
+	}
+
+	c->piped -= n;
+	c->remain -= n;
+	c->sent += n;
+
+	return n;
+}
+#endif
+
+/*
+ * Forget the previous request, keep what was read after it.
+ * Its memory and cache references live until its response is sent.
+ */
+static void
+client_reset(struct Client *c)
+{
+	client_hold(c);
+	c->f = -1;
+
+	memmove(c->rbuf, c->body, c->bsize);
+	c->rlen = c->bsize;
+	http_parser_init(&c->hp, conf.max_request_line, conf.max_header_size);
+	c->body = NULL;
+	c->bsize = 0;
+
+	c->smethod = c->sversion = c->uri = NULL;
+	c->path_info = c->query_string = c->vhost = NULL;
+	c->vh = NULL;
+	c->code = 0;
+	c->remain = 0;
+	c->offset = 0;
+	c->bmode = BODY_COPY;
+	c->ranges = NULL;
+	c->nranges = c->rcur = 0;
+
+	/* request memory, the connection keeps conf.arena_max bytes */
+	if (c->oqlen == 0) {
+		client_unhold(c);
+		arena_reset(&c->mem, conf.arena_max);
+	}
+
+	c->state = CL_READ;
+}
+
+static void
+client_hold(struct Client *c)
+{
+	if (!c->fce)
+		return;
+
+	if (c->nhold == c->hsize) {
+		c->hsize = MAX(c->hsize * 2, 8);
+		XREALLOC(c->hold, c->hsize * sizeof(*c->hold));
+	}
+
+	c->hold[c->nhold].e = c->fce;
+	c->hold[c->nhold].b = c->blob;
+	c->nhold++;
+	c->fce = NULL;
+	c->blob = NULL;
+}
+
+static void
+client_unhold(struct Client *c)
+{
+	struct ohold *h;
+
+	for (h = c->hold; h < c->hold + c->nhold; h++)
+	{
+		if (h->b)
+			fcache_blob_release(h->e, h->b);
+		fcache_release(h->e);
+	}
+	c->nhold = 0;
+}
+
+/*
+ * Parse the request read in rbuf and answer it
+ */
+void
+request_manage(struct Client *c)
+{
+	struct http_parser *hp = &c->hp;
+	char *conn;
+	int i;
+
+	/* tokens are NUL terminated in place */
 	do
 	{
 		c->code = 0;
+		c->obytes = 0;
 
-		if (!(hdrs = splitstr(c, (char*)data, "\r\n", &hdrs_size))
-				|| !hdrs[0]) {
-			c->code = 400;
-			break;
-		}
-	
-		if (!(line = splitstr(c, hdrs[0], " ", NULL)) || !line[0]
-				|| !line[1] || !line[2]) {
-			c->code = 400;
+		if (hp->state == HP_ERROR) {
+			c->code = hp->code;
+			c->method = NONE;
+			hp->nhdrs = 0;
 			break;
 		}
-	
-		c->smethod = line[0];
 
-		if (!strcmp(line[0], "GET"))
+		c->smethod = http_str(c->rbuf, &hp->method);
+
+		if (!strcmp(c->smethod, "GET"))
 			c->method = GET;
-		else if (!strcmp(line[0], "HEAD"))
+		else if (!strcmp(c->smethod, "HEAD"))
 			c->method = HEAD;
-		else if (!strcmp(line[0], "POST"))
+		else if (!strcmp(c->smethod, "POST"))
 			c->method = POST;
-		else if (!strcmp(line[0], "OPTIONS"))
+		else if (!strcmp(c->smethod, "OPTIONS"))
 			c->method = OPTIONS;
-		else if (!strcmp(line[0], "PUT"))
+		else if (!strcmp(c->smethod, "PUT"))
 			c->method = PUT;
-		else if (!strcmp(line[0], "DELETE"))
+		else if (!strcmp(c->smethod, "DELETE"))
 			c->method = DELETE;
-		else if (!strcmp(line[0], "TRACE"))
+		else if (!strcmp(c->smethod, "TRACE"))
 			c->method = TRACE;
-		else if (!strcmp(line[0], "CONNECT"))
+		else if (!strcmp(c->smethod, "CONNECT"))
 			c->method = CONNECT;
 		else {
 			c->method = NONE;
-			c->code = 400;
+			c->code = 405;
 			break;
 		}
-	
-		c->uri = line[1];
-	
+
+		c->uri = http_str(c->rbuf, &hp->uri);
+
 		if (c->uri[0] != '/' &&
 				strncmp(c->uri, "http://", 7)) {
 			c->code = 400;
 			break;
 		}
-	
-		c->sversion = line[2];
 
-		if (!strcmp(line[2], "HTTP/1.1"))
+		c->sversion = http_str(c->rbuf, &hp->version);
+
+		if (!strcmp(c->sversion, "HTTP/1.1"))
 			c->version = HTTP11;
-		else if (!strcmp(line[2], "HTTP/1.0"))
+		else if (!strcmp(c->sversion, "HTTP/1.0"))
 			c->version = HTTP10;
 		else {
-			c->code = (!strncmp(line[2], "HTTP/", 5)) ? 505 : 101;
+			c->code = (!strncmp(c->sversion, "HTTP/", 5)) ? 505 : 101;
 			break;
 		}
-	
-		for (i = 1; hdrs[i] != NULL; i++)
-		{
-			if (!(line[0] = strstr(hdrs[i], ": "))) {
-				c->code = 400;
-				break;
-			}
 
-			*line[0] = '\0';
-			line[0] += 2;
-			ZMALLOC(c, hel, sizeof(*hel));
-			hel->key = hdrs[i];
-			hel->val = line[0];
-			SLIST_INSERT_HEAD(&c->reqh, hel, next);
-			/*printf("'%s'->'%s'\n", hel->key, hel->val);*/
+		for (i = 0; i < hp->nhdrs; i++) {
+			http_str(c->rbuf, &hp->hdrs[i].key);
+			http_str(c->rbuf, &hp->hdrs[i].val);
 		}
 	} while (0);
 
@@ -252,69 +638,68 @@ request_manage(struct Client *c)
 		c->conn = KEEP_ALIVE;
 
 	/* for the moment only HEAD and GET */
-	if (c->method != HEAD && c->method != GET)
+	if (c->code == 0 && c->method != HEAD && c->method != GET)
 		c->code = 405;
 
 	/* error on request */
 	if (c->code != 0)
 	{
-		send_error(c);
-		warnx("%s - %d - %s", get_ipstring(&c->ss, ip),
-				c->code, status_get(c->code));
 		c->conn = CLOSE;
+		send_error(c);
 	}
 	else
-	{
 		send_uri(c);
-		warnx("%s - %s %s - %d %s", get_ipstring(&c->ss, ip),
-				c->smethod, c->uri, c->code, status_get(c->code));
-	}
+
+	alog_request(c);
+	metrics_request(c);
 
 	/* increment request count */
 	c->count++;
-
-	if (c->conn == KEEP_ALIVE)
-	{
-		/* closes eventually opened file */
-		if (c->f != -1) {
-			close(c->f);
-			c->f = -1;
-		}
-		return request_manage(c);
-	}
-
-	client_destroy(c);
 }
 
+/*
+ * prebuilt error response, the vhost page if it has one
+ */
 static void
 send_error(struct Client *c)
 {
-	char *msg;
-	if (c->code == 101 || c->code == 505)
-		header_set(c, "Upgrade", "HTTP/1.1");
+	send_error_hdr(c, NULL);
+}
 
-	zasprintf(c, &msg, "<h1 style=\"text-align: center;\">%d - %s</h1>",
-			c->code, status_get(c->code));
-	header_set(c, "Content-Length", "%d", strlen(msg));
-	header_set(c, "Connection", "close");
-	header_send(c);
+/*
+ * same with an additional header line
+ */
+static void
+send_error_hdr(struct Client *c, const char *hdr)
+{
+	const struct errpage *e;
+
+	if (!status_get(c->code))
+		c->code = 500;
 
-	HTTPD_WRITE(c, msg, strlen(msg));
+	for (e = c->vh ? c->vh->errors : NULL; e; e = e->next)
+		if (e->code == c->code)
+			break;
+	if (!e)
+		e = tmpl_error(c->code);
+
+	head_start(c, c->code);
+	if (hdr)
+		client_write(c, hdr, strlen(hdr));
+	client_write(c, e->hdrs, e->hlen);
+	head_end(c);
+	if (c->method != HEAD)
+		client_write(c, e->body, e->blen);
 }
 
 static void
 send_uri(struct Client *c)
 {
 	char *uri, *ptr;
-	char path[PATH_MAX];
-	char root[PATH_MAX];
-	char *requested = NULL;
-	char *etag; /* file etag */
-	char *cetag; /* client etag */
-	struct vhost *vh; 
-	struct stat st;
-	ssize_t n;
-	char buf[BUFSIZ];
+	char *range;
+	struct vhost *vh;
+	struct fcentry *fce, *v;
+	int accept, enc, retried = 0;
 
 	if (c->uri[0] == '/') {
 		ZSTRDUP(c, uri, c->uri);
@@ -350,144 +735,561 @@ send_uri(struct Client *c)
 
 	c->path_info = uri;
 
-	/* search vhost */
-	TAILQ_FOREACH(vh, &conf.vhosts, entry) {
-		if (!strcmp(vh->host, c->vhost)) {
-			ZMALLOC(c, requested, sizeof(char) *
-					(strlen(vh->root)+strlen(uri)+1));
-			strcpy(requested, vh->root);
-			strcat(requested, uri);
-			break;
-		}
-	}
-
 	/* no virtualhost found */
-	if (!requested) {
+	if (!(vh = vhost_find(c->vc, c->vhost))) {
 		c->code = 404;
 		return send_error(c);
 	}
+	c->vh = vh;
 
-	/* Check if requested is in root directory */
-	if (!realpath(requested, path) ||
-			!realpath(vh->root, root) ||
-			strncmp(path, root, strlen(root)))
-	{
-		c->code = 404;
+	uri_normalize(uri);
+lookup:
+	c->fce = fce = fcache_get(vh->vr, uri, ENC_IDENTITY);
+
+	if (fce->code) {
+		c->code = fce->code;
 		return send_error(c);
 	}
 
-	if (stat(path, &st) == -1 || !S_ISREG(st.st_mode)
-			|| (c->f = open(path, O_RDONLY)) == -1)
-	{
-		c->code = (errno == EACCES) ? 403 : 404;
+	/* best compressed variant, ranges always apply to the file itself */
+	if ((accept = accept_encoding(c)) && !header_get(c, "Range"))
+		for (enc = ENC_MAX - 1; enc > ENC_IDENTITY; enc--)
+		{
+			if (!(accept & (1 << enc)))
+				continue;
+			v = fcache_get(vh->vr, uri, enc);
+			if (v->code == 0) {
+				fcache_release(fce);
+				c->fce = fce = v;
+				break;
+			}
+			fcache_release(v);
+		}
+
+	/* revalidation, answered from the entry without opening the file */
+	if (not_modified(c, fce)) {
+		c->code = 304;
+		head_start(c, c->code);
+		client_write(c, fce->vhdrs, fce->vlen);
+		head_end(c);
+		return;
+	}
+	c->code = 200;
+
+	/* small file, answer with its prebuilt response */
+	if (!(range = header_get(c, "Range")) &&
+			(fce->zip || (fce->cached && conf.ccache_size &&
+				(size_t)fce->st.st_size <= conf.ccache_file_max))) {
+		if (send_blob(c, fce) == 0)
+			return;
+		/* a compressed body only exists in a blob */
+		if (fce->zip) {
+			if (errno == ESTALE && !retried++)
+				goto replaced;
+			c->code = (errno == EACCES) ? 403 : 500;
+			return send_error(c);
+		}
+	}
+
+	if (c->method != HEAD && (c->f = fcache_fd(fce)) == -1) {
+		if (errno == ESTALE && !retried++)
+			goto replaced;
+		c->code = (errno == EACCES) ? 403 :
+			(errno == ENOENT || errno == ENOTDIR) ? 404 : 500;
 		return send_error(c);
 	}
 
-	/* create etag */
-	zasprintf(c, &etag, "%lu%lu", (ulong_t)st.st_size, (ulong_t)st.st_mtime);
+	/* byte ranges, the whole file if the validator has changed */
+	if (range && c->method == GET && range_if(c, fce)) {
+		send_range(c, fce, range);
+		if (c->code != 200)
+			return;
+	}
 
-	/* compare etag */
-	if ((cetag = header_get(c, "If-None-Match")) &&
-			!strcmp(etag, cetag))
-		c->code = 304;
-	else
-		c->code = 200;
+	head_start(c, c->code);
+	client_write(c, fce->hdrs, fce->hlen);
+	head_end(c);
 
+	if (c->method != HEAD)
+		body_prepare(c, 0, fce->st.st_size);
+	return;
 
-	header_set(c, "Content-Length", "%lu", (ulong_t)st.st_size);
-	header_set(c, "Content-Type", "%s", get_mime_type(path));
-	header_set(c, "ETag", "%s", etag);
-	header_send(c);
+replaced:
+	/* replaced before inotify told, looked up again once */
+	fcache_stale(fce);
+	fcache_release(fce);
+	c->fce = NULL;
+	goto lookup;
+}
 
+/*
+ * RFC 9110 13.2.2 : If-None-Match, or If-Modified-Since without it,
+ * says the client copy of e is the current one
+ */
+static int
+not_modified(struct Client *c, struct fcentry *e)
+{
+	char *v;
+	time_t t;
 
-	if (c->method != HEAD && c->code == 200)
-		while ((n = read(c->f, buf, BUFSIZ)) != -1)
-		{
-			if (n == 0)
-				break;
-			HTTPD_WRITE(c, buf, n);
+	if ((v = header_get(c, "If-None-Match")))
+		return etag_match(v, e->etag);
+
+	if (!(v = header_get(c, "If-Modified-Since")))
+		return 0;
+
+	/* most clients send back the Last-Modified value */
+	if (!strcmp(v, e->lastmod))
+		return 1;
+
+	return (t = date_parse(v)) != -1 && e->st.st_mtime <= t;
+}
+
+/*
+ * weak comparison of etag against an If-None-Match list
+ */
+static int
+etag_match(const char *list, const char *etag)
+{
+	const char *p = list, *q;
+	size_t len = strlen(etag);
+
+	for (;;)
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '\0')
+			return 0;
+		if (*p == '*')
+			return 1;
+
+		if (!strncmp(p, "W/", 2))
+			p += 2;
+		/* a quoted tag may contain commas */
+		if (*p == '"' && (q = strchr(p + 1, '"'))) {
+			if ((size_t)(q - p + 1) == len && !memcmp(p, etag, len))
+				return 1;
+			p = q + 1;
 		}
+		p += strcspn(p, ",");
+	}
+}
 
+/*
+ * Accept-Encoding : mask of the enabled ENC_ codings the client takes,
+ * "*" stands for those it does not name and q=0 refuses one
+ */
+static int
+accept_encoding(struct Client *c)
+{
+	const char *p, *name;
+	size_t len;
+	int accept = 0, refuse = 0, star = 0, enc, zero;
+
+	if (!(p = header_get(c, "Accept-Encoding")))
+		return 0;
+
+	for (;;)
+	{
+		while (*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+		if (*p == '\0')
+			break;
+
+		name = p;
+		len = strcspn(p, " \t,;");
+		p += len;
+
+		/* only q=0 matters, any other weight accepts */
+		zero = 0;
+		while (*p == ' ' || *p == '\t' || *p == ';')
+			p++;
+		if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+			p += 2;
+			zero = (*p == '0');
+			for (p++; *p == '.' || *p == '0'; p++)
+				;
+			if (*p >= '1' && *p <= '9')
+				zero = 0;
+		}
+		p += strcspn(p, ",");
+
+		if (len == 1 && *name == '*') {
+			star = !zero;
+			continue;
+		}
+		if ((len == 4 && !strncasecmp(name, "gzip", 4)) ||
+				(len == 6 && !strncasecmp(name, "x-gzip", 6)))
+			enc = ENC_GZIP;
+		else if (len == 2 && !strncasecmp(name, "br", 2))
+			enc = ENC_BR;
+		else
+			continue;
+
+		if (zero)
+			refuse |= 1 << enc;
+		else
+			accept |= 1 << enc;
+	}
+
+	if (star)
+		accept |= ~refuse;
+	accept &= ~refuse;
+
+	if (!conf.precompressed)
+		accept &= (conf.compress ? 1 << ENC_GZIP : 0);
+
+	return accept & ((1 << ENC_GZIP) | (1 << ENC_BR));
 }
 
-static char *
-header_get(struct Client *c, const char *key)
+/*
+ * If-Range : ranges apply if the client copy is still the current one
+ */
+static int
+range_if(struct Client *c, struct fcentry *e)
 {
-	struct http_hdrs *h;
-	SLIST_FOREACH(h, &c->reqh, next)
-		if (!strcmp(key, h->key))
-			return h->val;
-	return NULL;
+	char *v;
+
+	if (!(v = header_get(c, "If-Range")))
+		return 1;
+
+	/* strong comparison, a weak tag never matches */
+	return !strcmp(v, e->etag) || !strcmp(v, e->lastmod);
+}
+
+/*
+ * Parse the "bytes=" spec of a size bytes file into *out, sorted with
+ * the overlapping and adjacent ranges coalesced (RFC 7233 4.1), a list
+ * repeating the file cannot amplify the response.
+ * Return the number of satisfiable ranges, 0 if none, -1 if the
+ * header is to be ignored (invalid or too many ranges).
+ */
+static int
+range_parse(struct Client *c, const char *spec, off_t size, struct brange **out)
+{
+	struct brange *r, t;
+	const char *p;
+	char *end;
+	long long a, b;
+	int i, j, n = 0, count = 0;
+
+	if (strncasecmp(spec, "bytes=", 6))
+		return -1;
+
+	ZMALLOC(c, r, (RANGE_MAX + 1) * sizeof(*r));
+
+	for (p = spec + 6; ; p++)
+	{
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		/* empty elements of the list are allowed */
+		if (*p == ',')
+			continue;
+		if (*p == '\0')
+			break;
+
+		a = b = -1;
+		if (*p != '-') {
+			if (*p < '0' || *p > '9')
+				return -1;
+			a = strtoll(p, &end, 10);
+			p = end;
+		}
+		if (*p++ != '-')
+			return -1;
+		if (*p >= '0' && *p <= '9') {
+			b = strtoll(p, &end, 10);
+			p = end;
+		}
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if ((*p != ',' && *p != '\0') || (a == -1 && b == -1) ||
+				a == LLONG_MAX || b == LLONG_MAX || (b != -1 && a > b))
+			return -1;
+
+		if (++count > RANGE_MAX)
+			return -1;
+
+		if (a == -1) {
+			/* suffix */
+			if (b == 0 || size == 0)
+				goto next;
+			r[n].start = (b >= size) ? 0 : size - b;
+			r[n].len = size - r[n].start;
+		}
+		else {
+			if (a >= size)
+				goto next;
+			r[n].start = a;
+			r[n].len = ((b == -1 || b >= size) ? size - 1 : b) - a + 1;
+		}
+		n++;
+next:
+		if (*p == '\0')
+			break;
+	}
+
+	if (count == 0)
+		return -1;
+
+	for (i = 1; i < n; i++) {
+		t = r[i];
+		for (j = i; j > 0 && r[j - 1].start > t.start; j--)
+			r[j] = r[j - 1];
+		r[j] = t;
+	}
+	for (i = 0, j = 1; j < n; j++) {
+		if (r[j].start <= r[i].start + r[i].len) {
+			r[i].len = MAX(r[i].len, r[j].start + r[j].len - r[i].start);
+			continue;
+		}
+		r[++i] = r[j];
+	}
+
+	*out = r;
+	return n ? i + 1 : 0;
 }
 
+/*
+ * answer the Range spec : 206 with one range or a multipart body
+ * streamed from the file, 416 if nothing is satisfiable, c->code is
+ * left to 200 when the whole file must be sent
+ */
 static void
-header_set(struct Client *c, const char *key, const char *fmt, ...)
+send_range(struct Client *c, struct fcentry *e, const char *spec)
 {
-	struct http_hdrs *h;
-	char *ptr = NULL;
-	va_list args;
+	struct brange *r;
+	unsigned long boundary;
+	off_t size = e->st.st_size, total;
+	char *hdr;
+	int i, n;
 
-	va_start(args, fmt);
-	vasprintf(&ptr, fmt, args);
-	va_end(args);
+	if ((n = range_parse(c, spec, size, &r)) == -1)
+		return;
 
-	if (!ptr)
+	if (n == 0) {
+		c->code = 416;
+		zasprintf(c, &hdr, "Content-Range: bytes */%lu\r\n", (ulong_t)size);
+		send_error_hdr(c, hdr);
 		return;
+	}
 
-	mstack_push(c, ptr);
+	c->code = 206;
+	head_start(c, c->code);
+
+	if (n == 1) {
+		zasprintf(c, &hdr, "Content-Type: %s\r\nContent-Length: %lu\r\n"
+				"Content-Range: bytes %lu-%lu/%lu\r\nLast-Modified: %s\r\n"
+				"Accept-Ranges: bytes\r\n%s", e->mime, (ulong_t)r->len,
+				(ulong_t)r->start, (ulong_t)(r->start + r->len - 1),
+				(ulong_t)size, e->lastmod, e->vhdrs);
+		client_write(c, hdr, strlen(hdr));
+		head_end(c);
+		body_prepare(c, r->start, r->len);
+		return;
+	}
 
-	SLIST_FOREACH(h, &c->resh, next)
+	/* multipart/byteranges, parts are sent by client_flush() */
+	boundary = (unsigned long)time(NULL) * 2654435761u ^ (uintptr_t)c ^ c->count;
+	total = 0;
+	for (i = 0; i < n; i++)
 	{
-		if (!strcmp(h->key, key))
-		{
-			h->val = ptr;
-			return;
+		zasprintf(c, &r[i].head, "\r\n--%016lx\r\nContent-Type: %s\r\n"
+				"Content-Range: bytes %lu-%lu/%lu\r\n\r\n", boundary, e->mime,
+				(ulong_t)r[i].start, (ulong_t)(r[i].start + r[i].len - 1),
+				(ulong_t)size);
+		r[i].hlen = strlen(r[i].head);
+		total += r[i].hlen + r[i].len;
+	}
+	r[n].start = r[n].len = 0;
+	zasprintf(c, &r[n].head, "\r\n--%016lx--\r\n", boundary);
+	r[n].hlen = strlen(r[n].head);
+	total += r[n].hlen;
+
+	zasprintf(c, &hdr, "Content-Type: multipart/byteranges; boundary=%016lx\r\n"
+			"Content-Length: %lu\r\nLast-Modified: %s\r\n"
+			"Accept-Ranges: bytes\r\n%s",
+			boundary, (ulong_t)total, e->lastmod, e->vhdrs);
+	client_write(c, hdr, strlen(hdr));
+	head_end(c);
+
+	c->ranges = r;
+	c->nranges = n + 1;
+	c->rcur = 0;
+	/* logged now, before client_flush() queues the parts */
+	c->obytes += total;
+}
+
+/*
+ * send the content cache response of e, building it on a miss.
+ * Return -1 if the file could not be read.
+ */
+static int
+send_blob(struct Client *c, struct fcentry *e)
+{
+	struct cblob *b;
+	struct iovec iov[3];
+	char *dyn, *zbody = NULL;
+	char clen[32];
+	size_t hlen, dlen, blen = e->st.st_size;
+	ssize_t n;
+	off_t off;
+	int fd;
+
+	if (!(b = fcache_blob(e)))
+	{
+		/* a compressed entry is compressed once, into its blob */
+		clen[0] = '\0';
+		if (e->zip) {
+			if (!(zbody = fcache_gzip(e, &blen)))
+				return -1;
+			snprintf(clen, sizeof(clen), "Content-Length: %lu\r\n",
+					(ulong_t)blen);
 		}
+
+		hlen = snprintf(NULL, 0, BLOB_HEADERS, conf.servername, clen, e->hdrs);
+		XMALLOC(b, sizeof(*b) + hlen + 3 + blen);
+		snprintf(b->data, hlen + 1, BLOB_HEADERS, conf.servername, clen, e->hdrs);
+		memcpy(b->data + hlen, "\r\n", 2);
+		b->hlen = hlen;
+		b->len = hlen + 2 + blen;
+
+		if (zbody) {
+			memcpy(b->data + hlen + 2, zbody, blen);
+			free(zbody);
+		}
+		else {
+			if ((fd = fcache_fd(e)) == -1) {
+				free(b);
+				return -1;
+			}
+			for (off = 0; off < e->st.st_size; off += n)
+			{
+				n = pread(fd, b->data + hlen + 2 + off,
+						e->st.st_size - off, off);
+				c->nsys++;
+				if (n <= 0) {
+					free(b);
+					return -1;
+				}
+			}
+		}
+
+		b = fcache_blob_set(e, b);
 	}
 
+	/* the only per request part */
+	ZMALLOC(c, dyn, DATE_LEN + 27);
+	memcpy(dyn, "Date: ", 6);
+	memcpy(dyn + 6, date_now(), DATE_LEN);
+	memcpy(dyn + 6 + DATE_LEN, "\r\n", 2);
+	dlen = DATE_LEN + 8;
+	if (c->conn == CLOSE) {
+		memcpy(dyn + dlen, "Connection: close\r\n", 19);
+		dlen += 19;
+	}
+
+	iov[0].iov_base = b->data;
+	iov[0].iov_len = b->hlen;
+	iov[1].iov_base = dyn;
+	iov[1].iov_len = dlen;
+	iov[2].iov_base = b->data + b->hlen;
+	iov[2].iov_len = (c->method == HEAD) ? 2 : b->len - b->hlen;
+	client_writev(c, iov, 3);
+
+	/* released with e once sent */
+	c->blob = b;
 
-	ZMALLOC(c, h, sizeof(*h));
-	ZSTRDUP(c, h->key, key);
-	h->val = ptr;
-	SLIST_INSERT_HEAD(&c->resh, h, next);
+	return 0;
 }
 
+/*
+ * choose how client_flush() sends len bytes of the file from off, a
+ * copied body starts in the same writev(2) as the headers. Its head
+ * is read in wbuf, or in the arena behind a pipelined one holding it,
+ * never more than an arena block takes.
+ */
 static void
-header_send(struct Client *c)
+body_prepare(struct Client *c, off_t off, off_t len)
 {
-	struct st_code *st;
-	char date[35];
-	struct http_hdrs *h;
+	char *head;
+	size_t size;
+	ssize_t n;
 
-	for (st = status_code; st->code != 0; st++)
-		if (st->code == c->code)
-			break;
+	c->offset = off;
+	c->remain = len;
+	c->bmode = BODY_COPY;
 
-	/* if any */
-	if (st->code == 0)
-	{
-		c->code = 500;
-		return header_send(c);
+#if defined (__linux__)
+	if ((size_t)len >= conf.sendfile_min) {
+		c->bmode = BODY_SENDFILE;
+		c->obytes += len;
+		return;
 	}
+#endif
 
-	if (c->conn == CLOSE)
-		header_set(c, "Connection", "close");
-	header_set(c, "Date", get_date(date));
-	header_set(c, "Server", conf.servername);
-
-	zwrite(c, "HTTP/1.1 %d %s\r\n", c->code, st->msg);
-	SLIST_FOREACH(h, &c->resh, next)
-		zwrite(c, "%s: %s\r\n", h->key, h->val);
-	zwrite(c, "\r\n");
+	if (!c->wheld) {
+		size = MIN(BUFSIZ, c->remain);
+		wbuf_reserve(c, size);
+		head = c->wbuf;
+		c->wheld = 1;
+	}
+	else {
+		size = MIN(ARENA_BLOCK / 2, c->remain);
+		ZMALLOC(c, head, size);
+	}
+	n = pread(c->f, head, size, off);
+	c->nsys++;
+	if (n > 0) {
+		client_write(c, head, n);
+		c->offset += n;
+		c->remain -= n;
+	}
+	c->obytes += c->remain;
 }
 
 static char *
-status_get(int code)
+header_get(struct Client *c, const char *key)
 {
-	struct st_code *st;
+	struct http_hdr *h;
+	size_t len = strlen(key);
+	int i;
 
-	for (st = status_code; st->code != 0; st++)
-		if (st->code == code)
-			return st->msg;
+	for (i = 0; i < c->hp.nhdrs; i++)
+	{
+		h = &c->hp.hdrs[i];
+		if (h->key.len == len &&
+				!strncasecmp(c->rbuf + h->key.off, key, len))
+			return c->rbuf + h->val.off;
+	}
 	return NULL;
 }
+
+/*
+ * queue the status line, Server and Date of a response
+ */
+static void
+head_start(struct Client *c, int code)
+{
+	const struct tmpl *t = tmpl_status(code);
+	char *p;
+
+	ZMALLOC(c, p, t->len);
+	memcpy(p, t->data, t->len);
+	memcpy(p + t->date, date_now(), DATE_LEN);
+	client_write(c, p, t->len);
+}
+
+/*
+ * queue the end of a response head
+ */
+static void
+head_end(struct Client *c)
+{
+	if (c->conn == CLOSE)
+		client_write(c, "Connection: close\r\n\r\n", 21);
+	else
+		client_write(c, "\r\n", 2);
+}
+
@@ -4,32 +4,45 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <pthread.h>
 #include <netinet/in.h>
 #include <err.h>
 
 #include "stack.h"
-
-#define HTTPD_WRITE(c, data, len)					\
-	do {											\
-		if (write(c->fd, data, len) == -1)			\
-			client_destroy(c);						\
-	} while (0)
+#include "http.h"
+#include "timer.h"
 
 #define ulong_t unsigned long
 
-struct http_hdrs {
-	char *key;
-	char *val;
-	SLIST_ENTRY(http_hdrs) next;
+struct worker;
+struct listener;
+struct vconf;
+struct fcentry;
+struct cblob;
+
+/* a part of a multipart/byteranges body, its head then its bytes */
+struct brange {
+	off_t	start;
+	off_t	len;
+	char	*head;
+	size_t	hlen;
+};
+
+/* cache references kept until the responses using them are sent */
+struct ohold {
+	struct fcentry	*e;
+	struct cblob	*b;
 };
 
 struct Client {
+	int					ev;		/* EV_CLIENT, must be first (see event.c) */
 	pthread_t			tid;
 	int					fd;
 	struct				sockaddr_storage ss;
-	SLIST_HEAD(, Stack) mstack;
+	struct arena		mem;		/* request memory */
 	enum { HTTP11, HTTP10 } version;	/* HTTP version */
 	char				*sversion;	/* version string */
 	enum { GET, HEAD, POST, OPTIONS,
@@ -42,24 +55,68 @@ struct Client {
 	void				*body;		/* body data */
 	size_t				bsize;		/* body size */
 	char				*vhost;		/* virtual host */
-	SLIST_HEAD(, http_hdrs) reqh;	/* request headers */
+	struct vconf		*vc;		/* vhosts when accepted, referenced */
+	struct vhost		*vh;
+	struct http_parser	hp;			/* request head, tokens in rbuf */
 	int					f;			/* open file */
+	struct fcentry		*fce;		/* cache entry of f */
+	struct cblob		*blob;		/* content cache response of fce */
 	int					code;		/* status code */
 	enum { KEEP_ALIVE, CLOSE } conn; /* connection type (keep-alive / close */
-	off_t				offset; /* data ofset */
+	off_t				offset; /* file offset of the body */
 	size_t				count; /* request count */
-	SLIST_HEAD(, http_hdrs) resh;		/* response headers */
+	unsigned long		nsys;	/* i/o system calls */
+	unsigned long		obytes;	/* response bytes, for the access log */
+	unsigned long		sent;	/* bytes written */
+	unsigned long		msent;	/* part of sent counted (metrics.c) */
+	unsigned long		msys;	/* part of nsys counted (metrics.c) */
+	struct timespec		mstart;	/* request start, for its latency */
 	SLIST_ENTRY(Client) next;
+
+	enum { CL_READ, CL_WRITE } state;	/* i/o state */
+	char				*rbuf;		/* receive buffer */
+	size_t				rlen;		/* bytes in rbuf */
+	size_t				rsize;		/* rbuf capacity */
+	struct iovec		*oq;		/* output segments, arena or held memory */
+	int					oqlen;		/* segments in oq */
+	int					oqoff;		/* segments of oq already sent */
+	int					oqsize;		/* oq capacity */
+	struct ohold		*hold;		/* references of answered requests */
+	int					nhold;
+	int					hsize;
+	char				*wbuf;		/* file body copy buffer */
+	size_t				wlen;		/* bytes in wbuf */
+	size_t				woff;		/* bytes of wbuf already sent */
+	size_t				wsize;		/* wbuf capacity */
+	int					wheld;		/* wbuf holds a body head of oq */
+	off_t				remain;		/* file bytes left to send */
+	enum { BODY_COPY, BODY_SENDFILE, BODY_SPLICE } bmode;	/* body path */
+	int					pipe[2];	/* splice(2) pipe */
+	size_t				piped;		/* body bytes waiting in the pipe */
+	struct brange		*ranges;	/* multipart parts, the last one ends it */
+	int					nranges;
+	int					rcur;		/* next part */
+	int					feed;		/* input pushed by client_feed(), -1 at its end */
+	int					uops;		/* ring operations in flight (uring.c) */
+	int					uflags;
+	struct worker		*w;			/* owning event loop */
+	struct listener		*l;			/* accepted on, for its slot */
+	struct timer		tm;			/* pending timeout (event.c) */
+	int					tkind;		/* what tm waits for */
+	unsigned long		tmark;		/* request count or sent when armed */
+	TAILQ_ENTRY(Client)	wentry;		/* worker idle list */
 };
 
 SLIST_HEAD(, Client) clients;
 
 struct Client *client_new(void);
 void client_destroy(struct Client *);
+int client_handle(struct Client *);
+void client_write(struct Client *, const void *, size_t);
+void client_writev(struct Client *, const struct iovec *, int);
+void client_feed(struct Client *, const void *, size_t);
 void request_manage(struct Client *);
 
-void mstack_push(struct Client *, void *);
-
 #define CLIENT_ADD(c)	SLIST_INSERT_HEAD(&clients, c, next)
 #include "tools.h"
 
@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * epoll engine : every worker runs an event loop on its own listening
+ * sockets and drives its non-blocking connections with client_handle().
+ * Each connection has one pending timeout in the worker timer wheel,
+ * for the request head, the response or the next request.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "metrics.h"
+
+#if defined (__linux__)
+
+#include <sys/epoll.h>
+
+#define EV_MAX	256
+
+/* one more tick, never expire early */
+#define TICKS(s)	((uint64_t)(s) * 1000 / TIMER_TICK + 1)
+
+enum { TM_NONE, TM_HEADER, TM_SEND, TM_IDLE };
+
+static void event_accept(struct worker *, struct listener *);
+static void event_client(struct worker *, struct Client *);
+static void event_resume(struct worker *);
+static void event_watch(struct worker *, struct listener *, int);
+
+static int ev_wake = EV_WAKE;
+
+/*
+ * create the worker epoll descriptor and watch its listening sockets
+ */
+int
+event_init(struct worker *w)
+{
+	struct epoll_event ev;
+
+	timer_init(&w->tw, timer_ticks());
+
+	if ((w->efd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		warn("epoll_create1");
+		return -1;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &ev_wake;
+	if (epoll_ctl(w->efd, EPOLL_CTL_ADD, w->wake[0], &ev) == -1) {
+		warn("epoll_ctl");
+		return -1;
+	}
+
+	worker_sync(w, event_watch);
+	return 0;
+}
+
+void *
+event_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event evs[EV_MAX];
+	int i, n;
+
+	for (;;)
+	{
+		if ((n = epoll_wait(w->efd, evs, EV_MAX,
+						w->tw.count ? TIMER_TICK : -1)) == -1) {
+			if (errno != EINTR)
+				err(EXIT_FAILURE, "epoll_wait");
+			continue;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			switch (*(int *)evs[i].data.ptr) {
+				case EV_LISTENER:
+					event_accept(w, evs[i].data.ptr);
+					break;
+				case EV_WAKE:
+					event_resume(w);
+					break;
+				default:
+					event_client(w, evs[i].data.ptr);
+					break;
+			}
+		}
+
+		event_expire(w);
+	}
+
+	return NULL;
+}
+
+static void
+event_accept(struct worker *w, struct listener *l)
+{
+	struct Client *c;
+	struct epoll_event ev;
+	socklen_t len;
+	int fd;
+
+	/* dropped by a reload earlier in this batch */
+	if (!l->seen[w->id])
+		return;
+
+	for (;;)
+	{
+		if (!conn_admit(l)) {
+			/* answer the excess, or leave it queued */
+			if (conf.retry_after > 0) {
+				if ((fd = accept4(l->fds[w->id], NULL, NULL,
+								SOCK_CLOEXEC)) == -1)
+					return;
+				conn_shed(fd);
+				continue;
+			}
+			if (epoll_ctl(w->efd, EPOLL_CTL_DEL, l->fds[w->id], NULL) == -1)
+				warn("epoll_ctl");
+			worker_pause(w, l);
+			if (!conn_full(l))
+				event_resume(w);
+			return;
+		}
+
+		c = client_new();
+		len = sizeof(c->ss);
+		if ((fd = accept4(l->fds[w->id], (struct sockaddr *)&c->ss, &len,
+						SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			metrics_accept(0);
+			conn_release(l);
+			free(c);
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		metrics_accept(1);
+		c->fd = fd;
+		c->w = w;
+		c->l = l;
+		c->tm.arg = c;
+
+		pthread_mutex_lock(&httpd_mtx);
+		CLIENT_ADD(c);
+		c->vc = vconf_get();
+		pthread_mutex_unlock(&httpd_mtx);
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = c;
+		if (epoll_ctl(w->efd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			warn("epoll_ctl");
+			event_close(w, c);
+			continue;
+		}
+		event_arm(w, c);
+	}
+}
+
+static void
+event_client(struct worker *w, struct Client *c)
+{
+	if (client_handle(c) == -1)
+		event_close(w, c);
+	else
+		event_arm(w, c);
+}
+
+/*
+ * pick the timeout of what c waits for, a request head is not extended
+ * by its bytes and a response only by sent ones
+ */
+void
+event_arm(struct worker *w, struct Client *c)
+{
+	unsigned long mark;
+	time_t t;
+	int kind;
+
+	if (c->state == CL_WRITE || c->oqlen > 0) {
+		kind = TM_SEND;
+		mark = c->sent;
+		t = conf.send_timeout;
+	}
+	else if (c->rlen > 0 || c->count == 0) {
+		kind = TM_HEADER;
+		mark = c->count;
+		t = conf.header_timeout;
+	}
+	else {
+		kind = TM_IDLE;
+		mark = c->count;
+		t = conf.keepalive_timeout;
+	}
+
+	if (kind == c->tkind && mark == c->tmark)
+		return;
+
+	if (c->tkind == TM_IDLE) {
+		TAILQ_REMOVE(&w->idle, c, wentry);
+		w->nidle--;
+	}
+	c->tkind = kind;
+	c->tmark = mark;
+
+	if (t > 0)
+		timer_add(&w->tw, &c->tm, TICKS(t));
+	else
+		timer_del(&w->tw, &c->tm);
+
+	if (kind != TM_IDLE)
+		return;
+
+	TAILQ_INSERT_TAIL(&w->idle, c, wentry);
+	w->nidle++;
+}
+
+void
+event_close(struct worker *w, struct Client *c)
+{
+	timer_del(&w->tw, &c->tm);
+	if (c->tkind == TM_IDLE) {
+		TAILQ_REMOVE(&w->idle, c, wentry);
+		w->nidle--;
+	}
+	c->tkind = TM_NONE;
+
+	if (conf.engine == ENGINE_URING)
+		uring_close(w, c);
+	else
+		client_destroy(c);
+}
+
+/*
+ * a connection closed : watch the listeners turned off at capacity.
+ * Or the listeners were reloaded.
+ */
+static void
+event_resume(struct worker *w)
+{
+	struct listener *l;
+	char buf[64];
+
+	while (read(w->wake[0], buf, sizeof(buf)) > 0)
+		;
+
+	if (__atomic_exchange_n(&w->reload, 0, __ATOMIC_SEQ_CST))
+		worker_sync(w, event_watch);
+
+	if (!worker_resume(w))
+		return;
+
+	pthread_mutex_lock(&httpd_mtx);
+	TAILQ_FOREACH(l, &conf.list, entry)
+	{
+		if (!l->seen[w->id] || !l->off[w->id])
+			continue;
+		l->off[w->id] = 0;
+		event_watch(w, l, 1);
+	}
+	pthread_mutex_unlock(&httpd_mtx);
+}
+
+/*
+ * watch l, level triggered : only one loop is woken for a shared
+ * socket. A paused listener is not watched already.
+ */
+static void
+event_watch(struct worker *w, struct listener *l, int on)
+{
+	struct epoll_event ev;
+
+	if (on) {
+		ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.ptr = l;
+		if (epoll_ctl(w->efd, EPOLL_CTL_ADD, l->fds[w->id], &ev) == -1)
+			warn("epoll_ctl");
+	}
+	else if (!l->off[w->id] &&
+			epoll_ctl(w->efd, EPOLL_CTL_DEL, l->fds[w->id], NULL) == -1)
+		warn("epoll_ctl");
+}
+
+/*
+ * close connections whose timeout expired, and the longest idle over
+ * the cap. Only after a batch, its later events may refer to them.
+ */
+void
+event_expire(struct worker *w)
+{
+	struct timer *t;
+	uint64_t now;
+
+	now = timer_ticks();
+	while ((t = timer_expired(&w->tw, now)))
+		event_close(w, t->arg);
+
+	while (w->idle_max > 0 && w->nidle > w->idle_max)
+		event_close(w, TAILQ_FIRST(&w->idle));
+}
+
+#else
+
+int
+event_init(struct worker *w)
+{
+	(void)w;
+	warnx("epoll engine not supported on this system");
+	return -1;
+}
+
+void *
+event_loop(void *arg)
+{
+	return arg;
+}
+
+#endif /* __linux__ */
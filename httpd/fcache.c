@@ -0,0 +1,996 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Open file cache : (root, uri) -> opened fd, stat, etag and mime type,
+ * or the error code for missing files. Entries are shared by all the
+ * workers (bodies are sent at explicit offsets), they expire after
+ * fcache-ttl seconds and are dropped as soon as inotify reports a change
+ * below a vhost root. Keyed by root, they stay valid across reloads
+ * keeping it.
+ *
+ * Small files may also carry their whole prebuilt response (content
+ * cache), each shard keeps at most ccache-size / FC_SHARDS bytes of them
+ * and evicts with a CLOCK over the entries holding one.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <zlib.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "fcache.h"
+
+#define FC_SHARDS	16
+
+/* smaller files are not worth a compressed variant */
+#define COMPRESS_MIN	256
+
+static const struct {
+	const char	*name;		/* Content-Encoding */
+	const char	*suffix;	/* precompressed sidecar */
+} codings[ENC_MAX] = {
+	{ "identity", "" },
+	{ "gzip", ".gz" },
+	{ "br", ".br" },
+};
+
+struct fcshard {
+	pthread_mutex_t			mtx;
+	struct fcentry			**tab;
+	struct fcentry			**ptab;		/* by path, for invalidations */
+	unsigned int			mask;
+	size_t					count;
+	size_t					max;
+	TAILQ_HEAD(, fcentry)	lru;		/* least recently used first */
+	TAILQ_HEAD(, fcentry)	ring[2];	/* entries with a blob, by e->zip */
+	struct fcentry			*hand[2];	/* CLOCK hands */
+	size_t					budget[2];	/* content and compressed bytes */
+	size_t					used[2];
+	struct fcstats			stats;
+};
+
+static struct fcshard shards[FC_SHARDS];
+static int fc_enabled;
+
+static unsigned int fcache_hash(struct vroot *, const char *);
+static unsigned int fcache_phash(const char *, size_t);
+static void fcache_open(struct fcentry *);
+static int fcache_file(struct fcentry *, const char *);
+static const char *fcache_rel(struct fcentry *);
+static int compressible(const char *);
+static void fcache_unlink(struct fcshard *, struct fcentry *);
+static void fcache_free(struct fcentry *);
+static void fcache_invalidate(const char *, int);
+static void invalidate(const char *, size_t, int);
+static void blob_drop(struct fcshard *, struct fcentry *);
+static void blob_unref(struct cblob *);
+#if defined (__linux__)
+static int fcache_watch_init(void);
+static void *fcache_watch(void *);
+#endif
+
+void
+fcache_init(void)
+{
+	struct rlimit rl;
+	unsigned int i, n;
+#if defined (__linux__)
+	struct vconf *vc;
+	pthread_t tid;
+#endif
+
+	for (i = 0; i < FC_SHARDS; i++) {
+		pthread_mutex_init(&shards[i].mtx, NULL);
+		TAILQ_INIT(&shards[i].lru);
+		TAILQ_INIT(&shards[i].ring[0]);
+		TAILQ_INIT(&shards[i].ring[1]);
+		shards[i].budget[0] = conf.ccache_size / FC_SHARDS;
+		shards[i].budget[1] = conf.compress_cache / FC_SHARDS;
+	}
+
+	if (conf.fcache_size == 0)
+		return;
+
+	/* a shard holds the largest compressed variant */
+	if (conf.compress && conf.compress_cache / FC_SHARDS < conf.compress_max) {
+		conf.compress_cache = FC_SHARDS * conf.compress_max;
+		warnx("compress-cache raised to %lu (compress-max)",
+				(ulong_t)conf.compress_cache);
+		for (i = 0; i < FC_SHARDS; i++)
+			shards[i].budget[1] = conf.compress_max;
+	}
+
+	/* every positive entry may hold a descriptor */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+			conf.fcache_size > rl.rlim_cur / 2) {
+		conf.fcache_size = rl.rlim_cur / 2;
+		warnx("fcache-size lowered to %lu (RLIMIT_NOFILE)",
+				(ulong_t)conf.fcache_size);
+	}
+
+	for (i = 0; i < FC_SHARDS; i++)
+	{
+		shards[i].max = MAX(conf.fcache_size / FC_SHARDS, 1);
+		for (n = 16; n < shards[i].max; n <<= 1)
+			;
+		shards[i].mask = n - 1;
+		XCALLOC(shards[i].tab, n, sizeof(struct fcentry *));
+		XCALLOC(shards[i].ptab, n, sizeof(struct fcentry *));
+	}
+
+	fc_enabled = 1;
+
+#if defined (__linux__)
+	if (fcache_watch_init() == -1)
+		return;
+
+	pthread_mutex_lock(&httpd_mtx);
+	vc = vconf_get();
+	pthread_mutex_unlock(&httpd_mtx);
+
+	if (pthread_create(&tid, NULL, fcache_watch, vc) != 0) {
+		warn("pthread_create");
+		vconf_put(vc);
+	}
+#endif
+}
+
+/*
+ * return a referenced entry for uri below vr in the enc content coding,
+ * release it with fcache_release()
+ */
+struct fcentry *
+fcache_get(struct vroot *vr, const char *uri, int enc)
+{
+	struct fcentry *e, **ep;
+	struct fcshard *s;
+	unsigned int h;
+	time_t now;
+
+	h = fcache_hash(vr, uri) ^ enc;
+	s = &shards[h % FC_SHARDS];
+
+	if (fc_enabled)
+	{
+		now = time(NULL);
+
+		pthread_mutex_lock(&s->mtx);
+		for (ep = &s->tab[h & s->mask]; (e = *ep); ep = &e->hnext)
+		{
+			if (e->hash != h || e->vr != vr || e->enc != enc ||
+					strcmp(e->uri, uri))
+				continue;
+
+			if (e->expire <= now) {
+				fcache_unlink(s, e);
+				break;
+			}
+
+			e->refcnt++;
+			TAILQ_REMOVE(&s->lru, e, lru);
+			TAILQ_INSERT_TAIL(&s->lru, e, lru);
+			s->stats.hits++;
+			pthread_mutex_unlock(&s->mtx);
+			return e;
+		}
+		s->stats.misses++;
+		pthread_mutex_unlock(&s->mtx);
+	}
+
+	XCALLOC(e, 1, sizeof(*e));
+	e->vr = vr;
+	XSTRDUP(e->uri, uri);
+	e->enc = enc;
+	e->hash = h;
+	e->fd = -1;
+	e->refcnt = 1;
+	fcache_open(e);
+
+	if (!fc_enabled)
+		return e;
+
+	e->expire = time(NULL) + conf.fcache_ttl;
+	e->phash = fcache_phash(e->path, strlen(e->path));
+
+	/* another worker may have raced us, the newest entry wins */
+	pthread_mutex_lock(&s->mtx);
+	for (ep = &s->tab[h & s->mask]; *ep; ep = &(*ep)->hnext)
+		if ((*ep)->hash == h && (*ep)->vr == vr && (*ep)->enc == enc &&
+				!strcmp((*ep)->uri, uri)) {
+			fcache_unlink(s, *ep);
+			break;
+		}
+
+	while (s->count >= s->max) {
+		fcache_unlink(s, TAILQ_FIRST(&s->lru));
+		s->stats.evictions++;
+	}
+
+	e->refcnt++;
+	e->cached = 1;
+	e->hnext = s->tab[h & s->mask];
+	s->tab[h & s->mask] = e;
+	e->pnext = s->ptab[e->phash & s->mask];
+	s->ptab[e->phash & s->mask] = e;
+	TAILQ_INSERT_TAIL(&s->lru, e, lru);
+	s->count++;
+	pthread_mutex_unlock(&s->mtx);
+
+	return e;
+}
+
+void
+fcache_release(struct fcentry *e)
+{
+	struct fcshard *s = &shards[e->hash % FC_SHARDS];
+	unsigned int ref;
+
+	pthread_mutex_lock(&s->mtx);
+	ref = --e->refcnt;
+	pthread_mutex_unlock(&s->mtx);
+
+	if (ref == 0)
+		fcache_free(e);
+}
+
+void
+fcache_stats(struct fcstats *st)
+{
+	unsigned int i;
+
+	memset(st, 0, sizeof(*st));
+
+	for (i = 0; i < FC_SHARDS; i++)
+	{
+		pthread_mutex_lock(&shards[i].mtx);
+		st->entries += shards[i].count;
+		st->hits += shards[i].stats.hits;
+		st->misses += shards[i].stats.misses;
+		st->evictions += shards[i].stats.evictions;
+		st->invalidations += shards[i].stats.invalidations;
+		st->cbytes += shards[i].stats.cbytes;
+		st->chits += shards[i].stats.chits;
+		st->cmisses += shards[i].stats.cmisses;
+		st->cevictions += shards[i].stats.cevictions;
+		pthread_mutex_unlock(&shards[i].mtx);
+	}
+}
+
+/* FNV-1a */
+static unsigned int
+fcache_hash(struct vroot *vr, const char *uri)
+{
+	unsigned int h = 2166136261u;
+	uintptr_t p = (uintptr_t)vr;
+	size_t i;
+
+	for (i = 0; i < sizeof(p); i++, p >>= 8)
+		h = (h ^ (p & 0xff)) * 16777619u;
+	for (; *uri; uri++)
+		h = (h ^ (unsigned char)*uri) * 16777619u;
+
+	return h;
+}
+
+static unsigned int
+fcache_phash(const char *path, size_t len)
+{
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)path[i]) * 16777619u;
+
+	return h;
+}
+
+/*
+ * resolve and check the file of e, on failure e->code is the status to
+ * answer. It is only opened by fcache_fd(), revalidations never need
+ * it. A coded variant is its precompressed sidecar (uri + ".gz" or
+ * ".br"), else for gzip the file itself compressed on the fly, and 404
+ * when there is neither.
+ */
+static void
+fcache_open(struct fcentry *e)
+{
+	const char *mime;
+	char clen[32], *vhdrs;
+	int n;
+
+	if (e->enc == ENC_IDENTITY) {
+		if (fcache_file(e, "") == -1)
+			return;
+		mime = get_mime_type(e->path);
+	}
+	else {
+		/* the type of the original, whatever the sidecar is named */
+		mime = get_mime_type(e->uri);
+
+		if (!conf.precompressed ||
+				fcache_file(e, codings[e->enc].suffix) == -1)
+		{
+			free(e->path);
+			e->path = NULL;
+
+			if (e->enc != ENC_GZIP || !conf.compress || !compressible(mime)) {
+				/* dropped when the original changes */
+				if (asprintf(&e->path, "%s%s", e->vr->path, e->uri) == -1)
+					err(EXIT_FAILURE, "asprintf");
+				e->code = 404;
+				return;
+			}
+
+			if (fcache_file(e, "") == -1)
+				return;
+			if (e->st.st_size < COMPRESS_MIN ||
+					(size_t)e->st.st_size > conf.compress_max) {
+				e->code = 404;
+				return;
+			}
+			e->zip = 1;
+		}
+	}
+
+	e->mime = mime;
+	date_format(e->st.st_mtime, e->lastmod);
+
+	/* strong validator : the file, and the coding of a variant */
+	if (asprintf(&e->etag, "\"%lx-%lx%s%s\"", (ulong_t)e->st.st_mtime,
+				(ulong_t)e->st.st_size, e->enc ? "-" : "",
+				e->enc ? codings[e->enc].name : "") == -1)
+		err(EXIT_FAILURE, "asprintf");
+
+	/* the part of the head a 304 repeats */
+	if (asprintf(&vhdrs, "ETag: %s\r\n%s", e->etag,
+				(e->enc || conf.precompressed ||
+				 (conf.compress && compressible(mime))) ?
+				"Vary: Accept-Encoding\r\n" : "") == -1)
+		err(EXIT_FAILURE, "asprintf");
+
+	/* the file part of every response head, the blob of a compressed
+	 * entry has its own length */
+	clen[0] = '\0';
+	if (!e->zip)
+		snprintf(clen, sizeof(clen), "Content-Length: %lu\r\n",
+				(ulong_t)e->st.st_size);
+	if (e->enc == ENC_IDENTITY)
+		n = asprintf(&e->hdrs, "%sContent-Type: %s\r\nLast-Modified: %s\r\n"
+				"Accept-Ranges: bytes\r\n%s", clen, e->mime, e->lastmod, vhdrs);
+	else
+		n = asprintf(&e->hdrs, "%sContent-Type: %s\r\nContent-Encoding: %s\r\n"
+				"Last-Modified: %s\r\n%s", clen, e->mime,
+				codings[e->enc].name, e->lastmod, vhdrs);
+	if (n == -1)
+		err(EXIT_FAILURE, "asprintf");
+	e->hlen = n;
+	e->vlen = strlen(vhdrs);
+	e->vhdrs = e->hdrs + n - e->vlen;
+	free(vhdrs);
+}
+
+/*
+ * stat uri + suffix of e below its root into e->path and e->st.
+ * Return -1 with e->code set on failure.
+ */
+static int
+fcache_file(struct fcentry *e, const char *suffix)
+{
+	struct vroot *vr = e->vr;
+	char path[PATH_MAX];
+	char *requested;
+
+	e->code = 0;
+
+	if (asprintf(&requested, "%s%s%s", vr->path, e->uri, suffix) == -1)
+		err(EXIT_FAILURE, "asprintf");
+
+	/* Check if requested is in root directory */
+	if (!realpath(requested, path) ||
+			strncmp(path, vr->path, vr->len) ||
+			(path[vr->len] != '/' && path[vr->len] != '\0'))
+	{
+		e->code = 404;
+		e->path = requested;
+		return -1;
+	}
+	free(requested);
+	XSTRDUP(e->path, path);
+
+	if (fstatat(vr->fd, fcache_rel(e), &e->st, 0) == -1) {
+		e->code = (errno == EACCES) ? 403 : 404;
+		return -1;
+	}
+	if (!S_ISREG(e->st.st_mode)) {
+		e->code = 404;
+		return -1;
+	}
+	/* what open(2) will say, supplementary groups and ACLs included */
+	if (faccessat(vr->fd, fcache_rel(e), R_OK, AT_EACCESS) == -1) {
+		e->code = (errno == EACCES || errno == EPERM) ? 403 : 404;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * path of e relative to the root descriptor opened at load time
+ */
+static const char *
+fcache_rel(struct fcentry *e)
+{
+	size_t len = e->vr->len;
+
+	return (e->path[len] == '/') ? e->path + len + 1 : ".";
+}
+
+/*
+ * the descriptor of e, opened by the first request sending its body.
+ * Return -1 with errno set if the file is gone or has changed since
+ * it was looked up.
+ */
+int
+fcache_fd(struct fcentry *e)
+{
+	struct stat st;
+	int fd, cur = -1;
+
+	if ((fd = __atomic_load_n(&e->fd, __ATOMIC_ACQUIRE)) != -1)
+		return fd;
+
+	if ((fd = openat(e->vr->fd, fcache_rel(e), O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+
+	/* replaced meanwhile, inotify drops e soon */
+	if (fstat(fd, &st) == -1 || st.st_ino != e->st.st_ino ||
+			st.st_dev != e->st.st_dev || st.st_size != e->st.st_size ||
+			st.st_mtime != e->st.st_mtime) {
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+
+#if defined (POSIX_FADV_SEQUENTIAL)
+	/* large files are read once, front to back */
+	if ((size_t)st.st_size > conf.sendfile_chunk) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		posix_fadvise(fd, 0, conf.sendfile_chunk, POSIX_FADV_WILLNEED);
+	}
+#endif
+
+	/* another request may have opened it too */
+	if (!__atomic_compare_exchange_n(&e->fd, &cur, fd, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		fd = cur;
+	}
+
+	return fd;
+}
+
+/*
+ * text types worth compressing, parameters ignored
+ */
+static int
+compressible(const char *mime)
+{
+	static const char *types[] = {
+		"application/javascript", "application/x-javascript",
+		"application/json", "application/xml", NULL
+	};
+	size_t len = strcspn(mime, "; ");
+	int i;
+
+	if (!strncmp(mime, "text/", 5))
+		return 1;
+	if ((len > 4 && !strncmp(mime + len - 4, "+xml", 4)) ||
+			(len > 5 && !strncmp(mime + len - 5, "+json", 5)))
+		return 1;
+	for (i = 0; types[i]; i++)
+		if (strlen(types[i]) == len && !strncmp(mime, types[i], len))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * gzip the whole file of e into a malloc'ed buffer of *len bytes,
+ * NULL if it could not be read
+ */
+char *
+fcache_gzip(struct fcentry *e, size_t *len)
+{
+	z_stream z;
+	unsigned char in[16384];
+	unsigned char *out;
+	size_t bound;
+	off_t off;
+	ssize_t n;
+	int fd, last, ret;
+
+	if ((fd = fcache_fd(e)) == -1)
+		return NULL;
+
+	memset(&z, 0, sizeof(z));
+	/* 16 + window bits : gzip wrapper */
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+				8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return NULL;
+
+	/* single output buffer, deflate() never runs out of room */
+	bound = deflateBound(&z, e->st.st_size);
+	XMALLOC(out, bound);
+	z.next_out = out;
+	z.avail_out = bound;
+
+	for (off = 0; ; off += n)
+	{
+		n = MIN((off_t)sizeof(in), e->st.st_size - off);
+		if (n > 0 && (n = pread(fd, in, n, off)) <= 0)
+			goto fail;
+
+		z.next_in = in;
+		z.avail_in = n;
+		last = (off + n == e->st.st_size);
+		ret = deflate(&z, last ? Z_FINISH : Z_NO_FLUSH);
+		if (last && ret == Z_STREAM_END)
+			break;
+		if (last || ret != Z_OK)
+			goto fail;
+	}
+
+	*len = z.total_out;
+	deflateEnd(&z);
+	return (char *)out;
+
+fail:
+	deflateEnd(&z);
+	free(out);
+	return NULL;
+}
+
+/*
+ * remove e from the cache, shard locked
+ */
+static void
+fcache_unlink(struct fcshard *s, struct fcentry *e)
+{
+	struct fcentry **ep;
+
+	for (ep = &s->tab[e->hash & s->mask]; *ep; ep = &(*ep)->hnext)
+		if (*ep == e) {
+			*ep = e->hnext;
+			break;
+		}
+	for (ep = &s->ptab[e->phash & s->mask]; *ep; ep = &(*ep)->pnext)
+		if (*ep == e) {
+			*ep = e->pnext;
+			break;
+		}
+
+	TAILQ_REMOVE(&s->lru, e, lru);
+	s->count--;
+	e->cached = 0;
+
+	if (e->blob)
+		blob_drop(s, e);
+
+	/* requests still using it will free it */
+	if (--e->refcnt == 0)
+		fcache_free(e);
+}
+
+static void
+fcache_free(struct fcentry *e)
+{
+	if (e->fd != -1)
+		close(e->fd);
+	free(e->uri);
+	free(e->path);
+	free(e->etag);
+	free(e->hdrs);
+	free(e);
+}
+
+/*
+ * return the referenced blob of e if any, release it with
+ * fcache_blob_release()
+ */
+struct cblob *
+fcache_blob(struct fcentry *e)
+{
+	struct fcshard *s = &shards[e->hash % FC_SHARDS];
+	struct cblob *b;
+
+	pthread_mutex_lock(&s->mtx);
+	if ((b = e->blob)) {
+		b->refcnt++;
+		e->used = 1;
+		s->stats.chits++;
+	}
+	else
+		s->stats.cmisses++;
+	pthread_mutex_unlock(&s->mtx);
+
+	return b;
+}
+
+/*
+ * attach b to e, return the blob to use (b or one set meanwhile),
+ * referenced. b is freed if it is not kept.
+ */
+struct cblob *
+fcache_blob_set(struct fcentry *e, struct cblob *b)
+{
+	struct fcshard *s = &shards[e->hash % FC_SHARDS];
+	struct fcentry *victim;
+	int k = e->zip;
+
+	b->refcnt = 1;
+
+	pthread_mutex_lock(&s->mtx);
+
+	if (e->blob || !e->cached || b->len > s->budget[k]) {
+		if (e->blob) {
+			blob_unref(b);
+			b = e->blob;
+			b->refcnt++;
+		}
+		pthread_mutex_unlock(&s->mtx);
+		return b;
+	}
+
+	/* CLOCK : skip and clear recently used entries */
+	while (s->used[k] + b->len > s->budget[k])
+	{
+		if (!s->hand[k])
+			s->hand[k] = TAILQ_FIRST(&s->ring[k]);
+		victim = s->hand[k];
+		s->hand[k] = TAILQ_NEXT(victim, ring);
+		if (victim->used) {
+			victim->used = 0;
+			continue;
+		}
+		blob_drop(s, victim);
+		s->stats.cevictions++;
+	}
+
+	b->refcnt++;
+	e->blob = b;
+	e->used = 0;
+	TAILQ_INSERT_TAIL(&s->ring[k], e, ring);
+	s->used[k] += b->len;
+	s->stats.cbytes += b->len;
+
+	pthread_mutex_unlock(&s->mtx);
+
+	return b;
+}
+
+void
+fcache_blob_release(struct fcentry *e, struct cblob *b)
+{
+	struct fcshard *s = &shards[e->hash % FC_SHARDS];
+
+	pthread_mutex_lock(&s->mtx);
+	blob_unref(b);
+	pthread_mutex_unlock(&s->mtx);
+}
+
+/*
+ * detach the blob of e, shard locked
+ */
+static void
+blob_drop(struct fcshard *s, struct fcentry *e)
+{
+	int k = e->zip;
+
+	if (s->hand[k] == e)
+		s->hand[k] = TAILQ_NEXT(e, ring);
+	TAILQ_REMOVE(&s->ring[k], e, ring);
+	s->used[k] -= e->blob->len;
+	s->stats.cbytes -= e->blob->len;
+	blob_unref(e->blob);
+	e->blob = NULL;
+}
+
+static void
+blob_unref(struct cblob *b)
+{
+	if (--b->refcnt == 0)
+		free(b);
+}
+
+/*
+ * drop the entries below vr, the last vhost using it is gone
+ */
+void
+fcache_forget(struct vroot *vr)
+{
+	struct fcentry *e, *next;
+	unsigned int i;
+
+	for (i = 0; i < FC_SHARDS; i++)
+	{
+		pthread_mutex_lock(&shards[i].mtx);
+		for (e = TAILQ_FIRST(&shards[i].lru); e; e = next)
+		{
+			next = TAILQ_NEXT(e, lru);
+			if (e->vr == vr)
+				fcache_unlink(&shards[i], e);
+		}
+		pthread_mutex_unlock(&shards[i].mtx);
+	}
+}
+
+/*
+ * drop e and the other entries of its file, found replaced before
+ * inotify told
+ */
+void
+fcache_stale(struct fcentry *e)
+{
+	fcache_invalidate(e->path, 0);
+}
+
+/*
+ * drop entries for path, and everything below it if below. The
+ * variants of a file are keyed by its own path when their sidecar is
+ * missing, a sidecar showing up drops them as well.
+ */
+static void
+fcache_invalidate(const char *path, int below)
+{
+	size_t len = strlen(path), slen;
+	int i;
+
+	invalidate(path, len, below);
+
+	for (i = ENC_IDENTITY + 1; i < ENC_MAX; i++) {
+		slen = strlen(codings[i].suffix);
+		if (len > slen && !strcmp(path + len - slen, codings[i].suffix))
+			invalidate(path, len - slen, below);
+	}
+}
+
+/*
+ * drop entries whose path is the len bytes of path, or only starts
+ * with them at a component boundary if below. A file is found through
+ * the path hash, a directory walks every entry.
+ */
+static void
+invalidate(const char *path, size_t len, int below)
+{
+	struct fcentry *e, *next, **ep;
+	struct fcshard *s;
+	unsigned int i, h = 0;
+
+	if (!below)
+		h = fcache_phash(path, len);
+
+	for (i = 0; i < FC_SHARDS; i++)
+	{
+		s = &shards[i];
+		pthread_mutex_lock(&s->mtx);
+		if (below) {
+			for (e = TAILQ_FIRST(&s->lru); e; e = next)
+			{
+				next = TAILQ_NEXT(e, lru);
+				if (!strncmp(e->path, path, len) &&
+						(e->path[len] == '\0' || e->path[len] == '/')) {
+					fcache_unlink(s, e);
+					s->stats.invalidations++;
+				}
+			}
+		}
+		else if (s->ptab) {
+			/* fcache_unlink() takes e out of the chain at *ep */
+			for (ep = &s->ptab[h & s->mask]; (e = *ep); )
+			{
+				if (e->phash == h && !strncmp(e->path, path, len) &&
+						e->path[len] == '\0') {
+					fcache_unlink(s, e);
+					s->stats.invalidations++;
+				}
+				else
+					ep = &e->pnext;
+			}
+		}
+		pthread_mutex_unlock(&s->mtx);
+	}
+}
+
+#if defined (__linux__)
+
+#include <ftw.h>
+#include <sys/inotify.h>
+
+#define FC_EVENTS	(IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | \
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+
+static int ifd = -1;
+static char **wdpath;		/* watched directory of each descriptor */
+static int wdsize;
+static pthread_mutex_t wd_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+watch_add(const char *dir)
+{
+	int wd;
+
+	if ((wd = inotify_add_watch(ifd, dir, FC_EVENTS)) == -1) {
+		warn("inotify_add_watch: %s", dir);
+		return;
+	}
+
+	pthread_mutex_lock(&wd_mtx);
+	if (wd >= wdsize) {
+		XREALLOC(wdpath, (wd + 64) * sizeof(char *));
+		memset(wdpath + wdsize, 0, (wd + 64 - wdsize) * sizeof(char *));
+		wdsize = wd + 64;
+	}
+
+	free(wdpath[wd]);
+	XSTRDUP(wdpath[wd], dir);
+	pthread_mutex_unlock(&wd_mtx);
+}
+
+static int
+watch_walk(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)ftw;
+
+	if (flag == FTW_D)
+		watch_add(path);
+
+	return 0;
+}
+
+/*
+ * whether an event may concern more than one file : the watched
+ * directory itself, a subdirectory, or a symlink that may stand for one
+ */
+static int
+watch_tree(struct inotify_event *ev, const char *path)
+{
+	struct stat st;
+
+	if (ev->len == 0 || (ev->mask & IN_ISDIR))
+		return 1;
+
+	return (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+		lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+}
+
+/*
+ * the roots of the startup configuration are walked by the watcher
+ */
+static int
+fcache_watch_init(void)
+{
+	struct vhost *vh;
+
+	if ((ifd = inotify_init1(IN_CLOEXEC)) == -1) {
+		warn("inotify_init1, open file cache relies on fcache-ttl");
+		return -1;
+	}
+
+	TAILQ_FOREACH(vh, &conf.vc->vhosts, entry)
+		vh->vr->watched = 1;
+
+	return 0;
+}
+
+/*
+ * watch the directories below the roots a reload opened
+ */
+void
+fcache_roots(struct vconf *vc)
+{
+	struct vhost *vh;
+
+	if (ifd == -1)
+		return;
+
+	TAILQ_FOREACH(vh, &vc->vhosts, entry)
+	{
+		if (vh->vr->watched)
+			continue;
+		vh->vr->watched = 1;
+		nftw(vh->vr->path, watch_walk, 16, FTW_PHYS);
+	}
+}
+
+/*
+ * watch every directory below the vhost roots
+ */
+static void *
+fcache_watch(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct vconf *vc = arg;
+	char *path;
+	struct inotify_event *ev;
+	struct vhost *vh;
+	ssize_t n;
+	char *p;
+
+	pthread_detach(pthread_self());
+
+	TAILQ_FOREACH(vh, &vc->vhosts, entry)
+		nftw(vh->vr->path, watch_walk, 16, FTW_PHYS);
+	vconf_put(vc);
+
+	for (;;)
+	{
+		if ((n = read(ifd, buf, sizeof(buf))) <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			warn("inotify");
+			return NULL;
+		}
+
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len)
+		{
+			ev = (struct inotify_event *)p;
+
+			/* events were lost, forget everything */
+			if (ev->mask & IN_Q_OVERFLOW) {
+				fcache_invalidate("", 1);
+				continue;
+			}
+
+			path = NULL;
+			pthread_mutex_lock(&wd_mtx);
+			if (ev->wd >= 0 && ev->wd < wdsize && wdpath[ev->wd] &&
+					asprintf(&path, "%s%s%s", wdpath[ev->wd],
+						ev->len ? "/" : "", ev->len ? ev->name : "") == -1)
+				path = NULL;
+			pthread_mutex_unlock(&wd_mtx);
+			if (!path)
+				continue;
+
+			if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+					(ev->mask & IN_ISDIR))
+				nftw(path, watch_walk, 16, FTW_PHYS);
+
+			fcache_invalidate(path, watch_tree(ev, path));
+			free(path);
+		}
+	}
+
+	return NULL;
+}
+
+#else
+
+void
+fcache_roots(struct vconf *vc)
+{
+	(void)vc;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,78 @@
+#ifndef H_FCACHE
+#define H_FCACHE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/queue.h>
+#include <time.h>
+
+struct vroot;
+struct vconf;
+
+/* content codings, in increasing order of preference */
+enum { ENC_IDENTITY, ENC_GZIP, ENC_BR, ENC_MAX };
+
+/* prebuilt response of a small file : headers, then "\r\n" and body */
+struct cblob {
+	unsigned int	refcnt;
+	size_t			hlen;		/* headers without the final CRLF */
+	size_t			len;		/* whole response */
+	char			data[];
+};
+
+/* an opened file, or the error to answer for it */
+struct fcentry {
+	struct vroot			*vr;		/* key : root and uri */
+	char					*uri;
+	int						enc;		/* and content coding */
+	unsigned int			hash;
+	char					*path;		/* resolved path, requested one if code */
+	int						code;		/* 0, or 403 / 404 */
+	int						fd;			/* -1 until fcache_fd() */
+	struct stat				st;
+	char					*etag;		/* quoted */
+	char					lastmod[DATE_LEN + 1];
+	char					*hdrs;		/* Content-Type, -Length, validators */
+	size_t					hlen;
+	char					*vhdrs;		/* ETag and Vary, the end of hdrs */
+	size_t					vlen;
+	int						zip;		/* gzip'ed on the fly, no Content-Length */
+	const char				*mime;
+	time_t					expire;
+	unsigned int			refcnt;		/* cache and requests references */
+	int						cached;		/* still in the cache */
+	struct fcentry			*hnext;		/* hash chain */
+	unsigned int			phash;		/* of path */
+	struct fcentry			*pnext;		/* path hash chain */
+	TAILQ_ENTRY(fcentry)	lru;
+	struct cblob			*blob;		/* content cache */
+	int						used;		/* CLOCK reference bit */
+	TAILQ_ENTRY(fcentry)	ring;		/* CLOCK ring of entries with a blob */
+};
+
+struct fcstats {
+	unsigned long	entries;
+	unsigned long	hits;
+	unsigned long	misses;
+	unsigned long	evictions;
+	unsigned long	invalidations;
+	unsigned long	cbytes;			/* content cache */
+	unsigned long	chits;
+	unsigned long	cmisses;
+	unsigned long	cevictions;
+};
+
+void fcache_init(void);
+struct fcentry *fcache_get(struct vroot *, const char *, int);
+void fcache_release(struct fcentry *);
+void fcache_stats(struct fcstats *);
+struct cblob *fcache_blob(struct fcentry *);
+struct cblob *fcache_blob_set(struct fcentry *, struct cblob *);
+void fcache_blob_release(struct fcentry *, struct cblob *);
+int fcache_fd(struct fcentry *);
+void fcache_stale(struct fcentry *);
+char *fcache_gzip(struct fcentry *, size_t *);
+void fcache_forget(struct vroot *);
+void fcache_roots(struct vconf *);
+
+#endif /* H_FCACHE */
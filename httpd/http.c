@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Request head parser. http_parse() is called again each time more
+ * bytes are read, it only looks at the new ones and records every token
+ * as an offset and a length into the buffer.
+ */
+
+#include <string.h>
+
+#if defined (__AVX2__) || defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "http.h"
+
+static int http_line(struct http_parser *, const char *, size_t, size_t);
+static int http_error(struct http_parser *, int);
+
+void
+http_parser_init(struct http_parser *hp, size_t max_line, size_t max_head)
+{
+	hp->state = HP_LINE;
+	hp->pos = hp->scan = 0;
+	hp->nhdrs = 0;
+	hp->code = 0;
+	hp->max_line = max_line;
+	hp->max_head = max_head;
+}
+
+/*
+ * NUL terminate token t of buf in place, the byte after a token is
+ * always a delimiter of the head
+ */
+char *
+http_str(char *buf, const struct http_tok *t)
+{
+	buf[t->off + t->len] = '\0';
+	return buf + t->off;
+}
+
+/*
+ * first occurrence of ch in [p, end), end if none. 32 or 16 bytes are
+ * compared at once when the cpu can.
+ */
+const char *
+http_findchr(const char *p, const char *end, int ch)
+{
+#if defined (__AVX2__)
+	__m256i c32 = _mm256_set1_epi8((char)ch);
+	unsigned int m;
+
+	for (; end - p >= 32; p += 32)
+		if ((m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c32,
+							_mm256_loadu_si256((const __m256i *)p)))))
+			return p + __builtin_ctz(m);
+#endif
+#if defined (__SSE2__)
+	__m128i c16 = _mm_set1_epi8((char)ch);
+	unsigned int m16;
+
+	for (; end - p >= 16; p += 16)
+		if ((m16 = _mm_movemask_epi8(_mm_cmpeq_epi8(c16,
+							_mm_loadu_si128((const __m128i *)p)))))
+			return p + __builtin_ctz(m16);
+#endif
+
+	for (; p < end; p++)
+		if (*p == ch)
+			return p;
+
+	return end;
+}
+
+/*
+ * Return 1 when the head is complete (hp->pos is then its size),
+ * 0 if more bytes are needed, -1 on error (hp->code is set).
+ */
+int
+http_parse(struct http_parser *hp, const char *buf, size_t len)
+{
+	const char *lf;
+	size_t end;
+
+	while (hp->state != HP_DONE && hp->state != HP_ERROR)
+	{
+		lf = http_findchr(buf + hp->scan, buf + len, '\n');
+		if (lf == buf + len)
+		{
+			hp->scan = len;
+			if (hp->state == HP_LINE && hp->max_line &&
+					len - hp->pos > hp->max_line)
+				return http_error(hp, 414);
+			if (hp->max_head && len > hp->max_head)
+				return http_error(hp, 413);
+			return 0;
+		}
+
+		/* line is [pos, end), without CRLF */
+		end = lf - buf;
+		if (end > hp->pos && buf[end - 1] == '\r')
+			end--;
+
+		if (http_line(hp, buf, hp->pos, end) == -1)
+			return -1;
+
+		hp->pos = hp->scan = lf - buf + 1;
+
+		if (hp->max_head && hp->pos > hp->max_head)
+			return http_error(hp, 413);
+	}
+
+	return (hp->state == HP_DONE) ? 1 : -1;
+}
+
+static int
+http_line(struct http_parser *hp, const char *buf, size_t start, size_t end)
+{
+	const char *p, *q, *e = buf + end;
+	struct http_hdr *h;
+
+	if (hp->state == HP_LINE)
+	{
+		/* tolerate empty lines before the request line */
+		if (start == end)
+			return 0;
+
+		if (hp->max_line && end - start > hp->max_line)
+			return http_error(hp, 414);
+
+		/* METHOD SP URI SP VERSION */
+		p = buf + start;
+		if ((q = http_findchr(p, e, ' ')) == e || q == p)
+			return http_error(hp, 400);
+		hp->method.off = start;
+		hp->method.len = q - p;
+
+		p = q + 1;
+		if ((q = http_findchr(p, e, ' ')) == e || q == p)
+			return http_error(hp, 400);
+		hp->uri.off = p - buf;
+		hp->uri.len = q - p;
+
+		p = q + 1;
+		if (p == e || http_findchr(p, e, ' ') != e)
+			return http_error(hp, 400);
+		hp->version.off = p - buf;
+		hp->version.len = e - p;
+
+		hp->state = HP_HEADERS;
+		return 0;
+	}
+
+	/* empty line, end of head */
+	if (start == end) {
+		hp->state = HP_DONE;
+		return 0;
+	}
+
+	if (hp->nhdrs == HTTP_MAX_HDRS)
+		return http_error(hp, 431);
+
+	/* KEY ":" OWS VALUE OWS, no folding */
+	p = buf + start;
+	if (*p == ' ' || *p == '\t' ||
+			(q = http_findchr(p, e, ':')) == e || q == p)
+		return http_error(hp, 400);
+
+	h = &hp->hdrs[hp->nhdrs++];
+	h->key.off = start;
+	h->key.len = q - p;
+
+	for (p = q + 1; p < e && (*p == ' ' || *p == '\t'); p++)
+		;
+	while (e > p && (e[-1] == ' ' || e[-1] == '\t'))
+		e--;
+	h->val.off = p - buf;
+	h->val.len = e - p;
+
+	return 0;
+}
+
+static int
+http_error(struct http_parser *hp, int code)
+{
+	hp->state = HP_ERROR;
+	hp->code = code;
+	return -1;
+}
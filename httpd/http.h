@@ -0,0 +1,42 @@
+#ifndef H_HTTP
+#define H_HTTP
+
+#include <stddef.h>
+
+#define HTTP_MAX_HDRS	64
+
+/* a token of the request, offset and length in the receive buffer */
+struct http_tok {
+	size_t	off;
+	size_t	len;
+};
+
+struct http_hdr {
+	struct http_tok	key;
+	struct http_tok	val;
+};
+
+/*
+ * resumable request head parser, nothing is copied : tokens point into
+ * the buffer given to http_parse()
+ */
+struct http_parser {
+	enum { HP_LINE, HP_HEADERS, HP_DONE, HP_ERROR } state;
+	size_t			pos;		/* start of the next line */
+	size_t			scan;		/* bytes already searched for LF */
+	struct http_tok	method;
+	struct http_tok	uri;
+	struct http_tok	version;
+	struct http_hdr	hdrs[HTTP_MAX_HDRS];
+	int				nhdrs;
+	int				code;		/* status to answer on HP_ERROR */
+	size_t			max_line;	/* limits, 0 for none */
+	size_t			max_head;
+};
+
+void http_parser_init(struct http_parser *, size_t, size_t);
+int http_parse(struct http_parser *, const char *, size_t);
+const char *http_findchr(const char *, const char *, int);
+char *http_str(char *, const struct http_tok *);
+
+#endif /* H_HTTP */
@@ -15,21 +15,63 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <sys/stat.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 
 #include "httpd.h"
 #include "client.h"
+#include "fcache.h"
+#include "tmpl.h"
+#include "alog.h"
+#include "metrics.h"
 
 struct httpd conf;
 pthread_mutex_t httpd_mtx = PTHREAD_MUTEX_INITIALIZER;
 
+static struct worker *workers;
+static const char *conf_file;
+static int conf_dir = -1;		/* relative paths of the configuration */
+static int npaused;				/* workers with a listener off */
+static unsigned long nshed;		/* connections answered 503 */
+static unsigned long npauses;	/* listeners turned off at capacity */
+static char *shed_hdrs;			/* end of the 503 head */
+static size_t shed_hlen;
+
+/* shed connections kept open until their request is read */
+#define SHED_DRAIN	256
+#define SHED_LINGER	2			/* seconds */
+static pthread_mutex_t shed_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shed_cond = PTHREAD_COND_INITIALIZER;
+static struct pollfd shed_pfd[SHED_DRAIN];
+static time_t shed_until[SHED_DRAIN];
+static nfds_t nshed_pfd;
+
 static void usage(void);
-static void *httpd_accept(void *arg);
+static int listener_open(struct listener *, int);
+static int listener_opts(struct listener *, int);
+static int sockopt(int, int, int, int, const char *);
+static int listener_same(const struct listener *, const struct listener *);
+static int listener_sockopts(const struct listener *, const struct listener *);
+static int listener_start(struct listener *);
+static void listener_retire(struct listener *);
+static void listener_close(struct listener *);
+static void workers_start(void);
+static void *worker_main(void *);
+static void *httpd_accept(struct worker *);
+static nfds_t accept_fds(struct worker *, struct pollfd **, struct listener ***);
 static void *serve(void *);
+static void shed_init(void);
+static void *shed_drain(void *);
+static void signal_block(void);
+static void *signal_main(void *);
+static void conf_reload(void);
 extern char *__progname;
 
 static void
@@ -52,7 +94,7 @@ main(int argc, char *argv[])
 	struct listener *l;
 	char *file = NULL;
 	char ip[INET6_ADDRSTRLEN];
-	socklen_t len;
+	long n;
 
 	while ((o = getopt(argc, argv, "df:h")) != EOF)
 	{
@@ -77,8 +119,23 @@ main(int argc, char *argv[])
 	}
 
 	/* get config */
-	if (parse_config(file) != 0)
+	if (parse_config(file, &conf) != 0)
 		exit(EXIT_FAILURE);
+	conf_file = file;
+
+	if (conf.workers == 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		conf.workers = (n > 0) ? n : 1;
+	}
+
+	if (conf.engine == ENGINE_URING && !uring_probe()) {
+		warn("io_uring unavailable, epoll engine used");
+		conf.engine = ENGINE_EPOLL;
+	}
+
+	/* reloads read the configuration from here */
+	if ((conf_dir = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		warn("reload disabled: .");
 
 	if (chdir("/") == -1)
 		err(1, "/");
@@ -87,52 +144,18 @@ main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 
 	/*
-	 * create socket for each listening address
+	 * create sockets for each listening address
 	 * TODO: some address from the conf may cause redundancy
 	 */
 	TAILQ_FOREACH(l, &conf.list, entry)
 	{
-
 		/* get ip string for the current listening socket */
 		warnx("listen %s on port %d", get_ipstring(&l->ss, ip), htons(l->port));
 
-		if ((l->fd = socket(l->ss.ss_family, SOCK_STREAM, 0)) == -1)
-		{
-			warn("socket");
-			l->running = 0;
-			continue;
-		}
-
-		/* set socket options */
-		if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR,
-					(int[]){1}, sizeof(int)) == -1 ||
-				setsockopt(l->fd, SOL_SOCKET, SO_RCVTIMEO,
-					&conf.timeout, sizeof(struct timeval)) == -1 ||
-				setsockopt(l->fd, SOL_SOCKET, SO_SNDTIMEO,
-					&conf.timeout, sizeof(struct timeval)) == -1)
-		{
-			warn("setsockopt");
-			l->running = 0;
-			continue;
-		}
-
-#if defined (__linux__)
-		len = sizeof(l->ss);
-#else
-		len = l->ss.ss_len;
-#endif
-
-		if (bind(l->fd, (struct sockaddr *)&l->ss, len) == -1) {
-			warn("%s", ip);
-			l->running = 0;
-			continue;
-		}
-		if (listen(l->fd, 5) < 0) {
-			warn("listen");
-			l->running = 0;
-			continue;
-		}
-		l->running = 1;
+		XCALLOC(l->fds, conf.workers, sizeof(int));
+		XCALLOC(l->off, conf.workers, 1);
+		XCALLOC(l->seen, conf.workers, 1);
+		l->running = (listener_open(l, conf.workers) == 0);
 	}
 
 	/* daemonize */
@@ -156,67 +179,876 @@ main(int argc, char *argv[])
 		freopen("/dev/null", "w", stderr);
 	}
 
-	TAILQ_FOREACH(l, &conf.list, entry)
+	signal_block();
+	tmpl_init();
+	if (conf.retry_after > 0)
+		shed_init();
+	fcache_init();
+	alog_init();
+	metrics_init();
+	workers_start();
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Take a connection slot of l and of the server, 0 at capacity
+ */
+int
+conn_admit(struct listener *l)
+{
+	if (__atomic_add_fetch(&conf.cur_conn, 1, __ATOMIC_SEQ_CST) > conf.max_conn) {
+		__atomic_sub_fetch(&conf.cur_conn, 1, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	if (__atomic_add_fetch(&l->cur_conn, 1, __ATOMIC_SEQ_CST) > l->opt.max_conn &&
+			l->opt.max_conn > 0) {
+		__atomic_sub_fetch(&l->cur_conn, 1, __ATOMIC_SEQ_CST);
+		__atomic_sub_fetch(&conf.cur_conn, 1, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
+
+int
+conn_full(struct listener *l)
+{
+	return __atomic_load_n(&conf.cur_conn, __ATOMIC_SEQ_CST) >= conf.max_conn ||
+		(l->opt.max_conn > 0 &&
+		 __atomic_load_n(&l->cur_conn, __ATOMIC_SEQ_CST) >= l->opt.max_conn);
+}
+
+/*
+ * Give the slot back, paused workers watch their listeners again
+ */
+void
+conn_release(struct listener *l)
+{
+	int i;
+
+	__atomic_sub_fetch(&l->cur_conn, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&conf.cur_conn, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&npaused, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	for (i = 0; i < conf.workers; i++)
+		if (__atomic_load_n(&workers[i].paused, __ATOMIC_SEQ_CST))
+			(void)!write(workers[i].wake[1], "", 1);
+}
+
+/*
+ * Stop watching l, full. The worker checks the capacity again after
+ * this : a slot released before it was paused woke nobody.
+ */
+void
+worker_pause(struct worker *w, struct listener *l)
+{
+	l->off[w->id] = 1;
+	__atomic_add_fetch(&npauses, 1, __ATOMIC_RELAXED);
+
+	if (!w->paused) {
+		__atomic_store_n(&w->paused, 1, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&npaused, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Back to watching every listener, 0 if w was not paused. The caller
+ * turns the listeners with off set on again.
+ */
+int
+worker_resume(struct worker *w)
+{
+	if (!w->paused)
+		return 0;
+
+	__atomic_store_n(&w->paused, 0, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&npaused, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/*
+ * Catch up with the listeners of the last reload, watch(w, l, 1) for
+ * the new ones and watch(w, l, 0) for the dropped ones. The sockets of
+ * a dropped listener are closed once no worker watches them.
+ */
+void
+worker_sync(struct worker *w, void (*watch)(struct worker *, struct listener *, int))
+{
+	struct listener *l, *next;
+
+	pthread_mutex_lock(&httpd_mtx);
+	for (l = TAILQ_FIRST(&conf.list); l; l = next)
+	{
+		next = TAILQ_NEXT(l, entry);
+
+		if (!l->gone && l->running && !l->seen[w->id]) {
+			l->seen[w->id] = 1;
+			l->nwatch++;
+			if (watch)
+				watch(w, l, 1);
+		}
+		else if (l->gone && l->seen[w->id]) {
+			if (watch)
+				watch(w, l, 0);
+			l->seen[w->id] = 0;
+			if (--l->nwatch == 0)
+				listener_close(l);
+		}
+	}
+	pthread_mutex_unlock(&httpd_mtx);
+}
+
+/*
+ * Answer a prebuilt 503 to a connection beyond capacity and close it,
+ * never blocking the accepting thread
+ */
+void
+conn_shed(int fd)
+{
+	const struct tmpl *t = tmpl_status(503);
+	const struct errpage *e = tmpl_error(503);
+	struct msghdr msg;
+	struct iovec iov[4];
+	char head[256];
+
+	memcpy(head, t->data, t->len);
+	memcpy(head + t->date, date_now(), DATE_LEN);
+
+	iov[0].iov_base = head;
+	iov[0].iov_len = t->len;
+	iov[1].iov_base = e->hdrs;
+	iov[1].iov_len = e->hlen;
+	iov[2].iov_base = shed_hdrs;
+	iov[2].iov_len = shed_hlen;
+	iov[3].iov_base = e->body;
+	iov[3].iov_len = e->blen;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 4;
+	(void)sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	shutdown(fd, SHUT_WR);
+
+	/* closed with its request unread, the 503 would be reset */
+	pthread_mutex_lock(&shed_mtx);
+	if (nshed_pfd < SHED_DRAIN) {
+		shed_pfd[nshed_pfd].fd = fd;
+		shed_pfd[nshed_pfd].events = POLLIN;
+		shed_pfd[nshed_pfd].revents = 0;
+		shed_until[nshed_pfd++] = time(NULL) + SHED_LINGER;
+		pthread_cond_signal(&shed_cond);
+		fd = -1;
+	}
+	pthread_mutex_unlock(&shed_mtx);
+	if (fd != -1)
+		close(fd);
+
+	__atomic_add_fetch(&nshed, 1, __ATOMIC_RELAXED);
+}
+
+void
+conn_stats(unsigned long *shed, unsigned long *pauses)
+{
+	*shed = __atomic_load_n(&nshed, __ATOMIC_RELAXED);
+	*pauses = __atomic_load_n(&npauses, __ATOMIC_RELAXED);
+}
+
+/*
+ * Retry-After and Connection, after the lines of the 503 page
+ */
+static void
+shed_init(void)
+{
+	pthread_t tid;
+	int n;
+
+	if ((n = asprintf(&shed_hdrs, "Retry-After: %ld\r\nConnection: close\r\n\r\n",
+					(long)conf.retry_after)) == -1)
+		err(EXIT_FAILURE, "asprintf");
+	shed_hlen = n;
+
+	if (pthread_create(&tid, NULL, shed_drain, NULL) != 0)
+		err(EXIT_FAILURE, "pthread_create");
+}
+
+/*
+ * read and discard what the shed connections send until they close
+ * or SHED_LINGER seconds have passed, connections added meanwhile
+ * are polled at the next round
+ */
+static void *
+shed_drain(void *arg)
+{
+	char buf[4096];
+	nfds_t i, j, n;
+	time_t now;
+	ssize_t r;
+
+	(void)arg;
+	pthread_detach(pthread_self());
+
+	for (;;)
 	{
-		if (l->running && pthread_create(&l->tid, NULL, httpd_accept, (void*)l) != 0)
+		pthread_mutex_lock(&shed_mtx);
+		while (nshed_pfd == 0)
+			pthread_cond_wait(&shed_cond, &shed_mtx);
+		n = nshed_pfd;
+		pthread_mutex_unlock(&shed_mtx);
+
+		/* conn_shed() only appends past n */
+		if (poll(shed_pfd, n, 200) == -1 && errno != EINTR)
+			warn("poll");
+		now = time(NULL);
+
+		pthread_mutex_lock(&shed_mtx);
+		for (i = j = 0; i < nshed_pfd; i++)
 		{
-			warn("pthread_create");
-			l->running = 0;
+			r = 1;
+			if (i < n && shed_pfd[i].revents)
+				r = recv(shed_pfd[i].fd, buf, sizeof(buf), MSG_DONTWAIT);
+			if (r == 0 || (r == -1 && errno != EAGAIN) ||
+					now >= shed_until[i]) {
+				close(shed_pfd[i].fd);
+				continue;
+			}
+			shed_pfd[i].revents = 0;
+			shed_pfd[j] = shed_pfd[i];
+			shed_until[j++] = shed_until[i];
 		}
+		nshed_pfd = j;
+		pthread_mutex_unlock(&shed_mtx);
 	}
 
-	TAILQ_FOREACH(l, &conf.list, entry)
+	return NULL;
+}
+
+/*
+ * signals are blocked in every thread and handled by signal_main(),
+ * started with the workers
+ */
+static void
+signal_block(void)
+{
+	sigset_t set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void *
+signal_main(void *arg)
+{
+	struct fcstats fst;
+	sigset_t set;
+	int sig;
+
+	(void)arg;
+	pthread_detach(pthread_self());
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+
+	for (;;)
 	{
-		if (l->running)
-			pthread_join(l->tid, NULL);
+		if (sigwait(&set, &sig) != 0)
+			continue;
+
+		switch (sig) {
+			case SIGHUP:
+				conf_reload();
+				break;
+			case SIGUSR1:
+				alog_reopen();
+				break;
+			case SIGUSR2:
+				fcache_stats(&fst);
+				warnx("fcache: %lu entries, %lu hits, %lu misses, "
+						"%lu evictions, %lu invalidations",
+						fst.entries, fst.hits, fst.misses,
+						fst.evictions, fst.invalidations);
+				warnx("ccache: %lu bytes, %lu hits, %lu misses, "
+						"%lu evictions", fst.cbytes, fst.chits,
+						fst.cmisses, fst.cevictions);
+				warnx("access log: %lu dropped", alog_dropped());
+				warnx("admission: %lu shed, %lu pauses",
+						__atomic_load_n(&nshed, __ATOMIC_RELAXED),
+						__atomic_load_n(&npauses, __ATOMIC_RELAXED));
+				break;
+		}
 	}
 
-	return EXIT_SUCCESS;
+	return NULL;
+}
+
+/*
+ * SIGHUP : load the configuration file again. New connections get the
+ * new vhosts, open ones keep theirs until they close. A listener of the
+ * same address and socket options keeps its sockets, a changed one is
+ * replaced once its new sockets are open, the others are opened or
+ * closed. Other settings are only read at startup.
+ */
+static void
+conf_reload(void)
+{
+	struct httpd nc;
+	TAILQ_HEAD(, listener) add = TAILQ_HEAD_INITIALIZER(add);
+	struct listener *l, *nl, *next;
+	struct vconf *old;
+	char ip[INET6_ADDRSTRLEN];
+	size_t max;
+	int i, error;
+
+	if (conf_dir == -1 || fchdir(conf_dir) == -1) {
+		warnx("%s: not reloaded", conf_file);
+		return;
+	}
+
+	memset(&nc, 0, sizeof(nc));
+	error = parse_config(conf_file, &nc) != 0 || alog_vhosts(nc.vc) == -1;
+
+	if (chdir("/") == -1)
+		warn("/");
+
+	/* the startup values stay */
+	free(nc.servername);
+	free(nc.logfile);
+	free(nc.metrics_addr);
+
+	if (error) {
+		warnx("%s: not reloaded", conf_file);
+		while ((nl = TAILQ_FIRST(&nc.list))) {
+			TAILQ_REMOVE(&nc.list, nl, entry);
+			free(nl);
+		}
+		vconf_put(nc.vc);
+		return;
+	}
+
+	/* before any request can cache a file below them */
+	fcache_roots(nc.vc);
+
+	pthread_mutex_lock(&httpd_mtx);
+
+	for (l = TAILQ_FIRST(&conf.list); l; l = next)
+	{
+		next = TAILQ_NEXT(l, entry);
+		if (l->gone)
+			continue;
+
+		TAILQ_FOREACH(nl, &nc.list, entry)
+			if (listener_same(l, nl))
+				break;
+		if (!nl) {
+			listener_retire(l);
+			continue;
+		}
+		TAILQ_REMOVE(&nc.list, nl, entry);
+
+		/* unchanged sockets, no accept gap */
+		if (l->running && listener_sockopts(l, nl)) {
+			__atomic_store_n(&l->opt.max_conn, nl->opt.max_conn,
+					__ATOMIC_RELAXED);
+			free(nl);
+			continue;
+		}
+
+		/* the old sockets until the new ones are open */
+		max = nl->opt.max_conn;
+		if (listener_start(nl) == 0) {
+			TAILQ_INSERT_TAIL(&add, nl, entry);
+			listener_retire(l);
+		}
+		else if (l->running) {
+			warnx("options of %s on port %d not changed",
+					get_ipstring(&l->ss, ip), htons(l->port));
+			__atomic_store_n(&l->opt.max_conn, max, __ATOMIC_RELAXED);
+		}
+	}
+
+	while ((nl = TAILQ_FIRST(&nc.list)))
+	{
+		TAILQ_REMOVE(&nc.list, nl, entry);
+		if (listener_start(nl) == 0)
+			TAILQ_INSERT_TAIL(&add, nl, entry);
+	}
+	while ((nl = TAILQ_FIRST(&add)))
+	{
+		TAILQ_REMOVE(&add, nl, entry);
+		TAILQ_INSERT_TAIL(&conf.list, nl, entry);
+	}
+
+	old = conf.vc;
+	conf.vc = nc.vc;
+
+	pthread_mutex_unlock(&httpd_mtx);
+
+	vconf_put(old);
+
+	for (i = 0; i < conf.workers; i++) {
+		__atomic_store_n(&workers[i].reload, 1, __ATOMIC_SEQ_CST);
+		(void)!write(workers[i].wake[1], "", 1);
+	}
+
+	warnx("%s reloaded", conf_file);
+}
+
+/*
+ * Open the listening sockets of l, one per worker so the kernel spreads
+ * connections (SO_REUSEPORT), a single shared one where it does not
+ * balance them
+ */
+static int
+listener_open(struct listener *l, int n)
+{
+	int i, fd;
+	socklen_t len;
+	char ip[INET6_ADDRSTRLEN];
+	struct timeval rcv, snd;
+
+	/* blocking thread engine, the epoll one runs its timer wheel */
+	rcv.tv_sec = conf.keepalive_timeout;
+	rcv.tv_usec = 0;
+	snd.tv_sec = conf.send_timeout;
+	snd.tv_usec = 0;
+
+#if !defined (__linux__) || !defined (SO_REUSEPORT)
+	n = 1;
+#endif
+
+	get_ipstring(&l->ss, ip);
+
+#if defined (__linux__)
+	len = sizeof(l->ss);
+#else
+	len = l->ss.ss_len;
+#endif
+
+	for (i = 0; i < n; i++)
+	{
+		if ((fd = socket(l->ss.ss_family, SOCK_STREAM, 0)) == -1)
+		{
+			warn("socket");
+			goto fail;
+		}
+		l->fds[i] = fd;
+
+		/* set socket options */
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+					(int[]){1}, sizeof(int)) == -1 ||
+#if defined (__linux__) && defined (SO_REUSEPORT)
+				setsockopt(fd, SOL_SOCKET, SO_REUSEPORT,
+					(int[]){1}, sizeof(int)) == -1 ||
+#endif
+				setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+					&rcv, sizeof(struct timeval)) == -1 ||
+				setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+					&snd, sizeof(struct timeval)) == -1)
+		{
+			warn("setsockopt");
+			i++;
+			goto fail;
+		}
+
+		if (listener_opts(l, fd) == -1) {
+			i++;
+			goto fail;
+		}
+
+		if (bind(fd, (struct sockaddr *)&l->ss, len) == -1) {
+			warn("%s", ip);
+			i++;
+			goto fail;
+		}
+
+		if (listen(fd, l->opt.backlog ? l->opt.backlog : conf.backlog) < 0) {
+			warn("listen");
+			i++;
+			goto fail;
+		}
+
+		/* event loops must never block on accept */
+		if (conf.engine != ENGINE_THREAD &&
+				fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+			warn("fcntl");
+			i++;
+			goto fail;
+		}
+	}
+
+	/* no per worker socket, share the first one */
+	for (; i < conf.workers; i++)
+		l->fds[i] = l->fds[0];
+
+	return 0;
+
+fail:
+	while (i-- > 0)
+		close(l->fds[i]);
+	return -1;
+}
+
+/*
+ * same address
+ */
+static int
+listener_same(const struct listener *a, const struct listener *b)
+{
+	return a->port == b->port && !memcmp(&a->ss, &b->ss, sizeof(a->ss));
+}
+
+/*
+ * same options set on the sockets, max-conn is only checked at accept
+ */
+static int
+listener_sockopts(const struct listener *a, const struct listener *b)
+{
+	const struct lopts *x = &a->opt, *y = &b->opt;
+
+	return x->backlog == y->backlog && x->defer_accept == y->defer_accept &&
+		x->fastopen == y->fastopen && x->nodelay == y->nodelay &&
+		x->sndbuf == y->sndbuf && x->rcvbuf == y->rcvbuf &&
+		x->keepidle == y->keepidle && x->keepintvl == y->keepintvl &&
+		x->keepcnt == y->keepcnt;
+}
+
+/*
+ * open the sockets of a listener added by a reload, httpd_mtx held.
+ * l is freed on failure.
+ */
+static int
+listener_start(struct listener *l)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	warnx("listen %s on port %d", get_ipstring(&l->ss, ip), htons(l->port));
+
+	XCALLOC(l->fds, conf.workers, sizeof(int));
+	XCALLOC(l->off, conf.workers, 1);
+	XCALLOC(l->seen, conf.workers, 1);
+	if (listener_open(l, conf.workers) == -1) {
+		free(l->fds);
+		free(l->off);
+		free(l->seen);
+		free(l);
+		return -1;
+	}
+	l->running = 1;
+	return 0;
+}
+
+/*
+ * drop l, its sockets are closed once no worker watches them
+ */
+static void
+listener_retire(struct listener *l)
+{
+	char ip[INET6_ADDRSTRLEN];
+
+	warnx("stop listening %s on port %d", get_ipstring(&l->ss, ip),
+			htons(l->port));
+	l->gone = 1;
+	if (l->nwatch == 0)
+		listener_close(l);
+}
+
+/*
+ * dropped listener no worker watches, httpd_mtx held. The structure is
+ * kept, its connections still release their slot in it.
+ */
+static void
+listener_close(struct listener *l)
+{
+	int i;
+
+	for (i = 0; l->running && i < conf.workers; i++)
+		if (i == 0 || l->fds[i] != l->fds[0])
+			close(l->fds[i]);
+	l->running = 0;
+
+	TAILQ_REMOVE(&conf.list, l, entry);
+}
+
+/*
+ * Options of the listen line. Accepted sockets inherit the buffer
+ * sizes, TCP_NODELAY and the keepalive settings.
+ */
+static int
+listener_opts(struct listener *l, int fd)
+{
+	const struct lopts *o = &l->opt;
+
+	if ((o->sndbuf && sockopt(fd, SOL_SOCKET, SO_SNDBUF, o->sndbuf,
+					"sndbuf") == -1) ||
+			(o->rcvbuf && sockopt(fd, SOL_SOCKET, SO_RCVBUF, o->rcvbuf,
+					"rcvbuf") == -1) ||
+			(o->nodelay && sockopt(fd, IPPROTO_TCP, TCP_NODELAY, 1,
+					"nodelay") == -1))
+		return -1;
+
+	if (o->keepidle || o->keepintvl || o->keepcnt) {
+		if (sockopt(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "keepalive") == -1)
+			return -1;
+#if defined (TCP_KEEPIDLE) && defined (TCP_KEEPINTVL) && defined (TCP_KEEPCNT)
+		if ((o->keepidle && sockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+						o->keepidle, "keepidle") == -1) ||
+				(o->keepintvl && sockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+						o->keepintvl, "keepintvl") == -1) ||
+				(o->keepcnt && sockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,
+						o->keepcnt, "keepcnt") == -1))
+			return -1;
+#else
+		warnx("keepalive timers not supported, system defaults used");
+#endif
+	}
+
+	/* wake up for connections with a request only */
+	if (o->defer_accept) {
+#if defined (TCP_DEFER_ACCEPT)
+		if (sockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, o->defer_accept,
+					"defer-accept") == -1)
+			return -1;
+#else
+		warnx("defer-accept not supported on this system");
+#endif
+	}
+
+	if (o->fastopen) {
+#if defined (TCP_FASTOPEN)
+		if (sockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, o->fastopen,
+					"fastopen") == -1)
+			return -1;
+#else
+		warnx("fastopen not supported on this system");
+#endif
+	}
+
+	return 0;
+}
+
+/*
+ * set an int socket option, one the system or the protocol lacks is
+ * reported and skipped
+ */
+static int
+sockopt(int fd, int level, int name, int val, const char *what)
+{
+	if (setsockopt(fd, level, name, &val, sizeof(val)) == 0)
+		return 0;
+
+	if (errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+		warn("%s, skipped", what);
+		return 0;
+	}
+	warn("%s", what);
+	return -1;
+}
+
+static void
+workers_start(void)
+{
+	pthread_t tid;
+	int i;
+
+	XCALLOC(workers, conf.workers, sizeof(*workers));
+
+	for (i = 0; i < conf.workers; i++)
+	{
+		workers[i].id = i;
+		TAILQ_INIT(&workers[i].idle);
+		workers[i].idle_max = (conf.max_idle + conf.workers - 1) / conf.workers;
+
+		if (pipe(workers[i].wake) == -1 ||
+				fcntl(workers[i].wake[0], F_SETFL, O_NONBLOCK) == -1 ||
+				fcntl(workers[i].wake[1], F_SETFL, O_NONBLOCK) == -1)
+			err(EXIT_FAILURE, "pipe");
+
+		if (conf.engine == ENGINE_EPOLL && event_init(&workers[i]) == -1)
+			exit(EXIT_FAILURE);
+
+		if (pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]) != 0)
+			err(EXIT_FAILURE, "pthread_create");
+	}
+
+	/* a reload wakes the workers */
+	if (pthread_create(&tid, NULL, signal_main, NULL) != 0)
+		warn("pthread_create");
+
+	for (i = 0; i < conf.workers; i++)
+		pthread_join(workers[i].tid, NULL);
 }
 
 static void *
-httpd_accept(void *arg)
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+#if defined (__linux__)
+	cpu_set_t set;
+	long ncpu;
+
+	if (conf.affinity) {
+		if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncpu = 1;
+		CPU_ZERO(&set);
+		CPU_SET(w->id % ncpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			warnx("worker %d: cannot pin to cpu %ld", w->id, w->id % ncpu);
+	}
+#endif
+
+	if (conf.engine == ENGINE_EPOLL)
+		return event_loop(w);
+	if (conf.engine == ENGINE_URING)
+		return uring_loop(w);
+
+	return httpd_accept(w);
+}
+
+/*
+ * thread engine : accept on the worker sockets and serve each
+ * connection with its own thread
+ */
+static void *
+httpd_accept(struct worker *w)
 {
 	socklen_t len;
 	struct Client *c;
-	struct listener *l = arg;
-	size_t cur_conn;
+	struct listener *l, **ls;
+	struct pollfd *pfd;
+	char buf[64];
+	nfds_t i, n;
+	int fd;
+
+	n = accept_fds(w, &pfd, &ls);
 
 	c = client_new();
 	for(;;)
 	{
-		pthread_mutex_lock(&httpd_mtx);
-		cur_conn = conf.cur_conn;
-		pthread_mutex_unlock(&httpd_mtx);
-
-		if (cur_conn > conf.max_conn)
+		if (poll(pfd, n + 1, -1) == -1)
 			continue;
 
-		len = sizeof(*l);
-		if ((c->fd = accept(l->fd, (struct sockaddr*)&c->ss, &len)) < 0)
-			continue;
+		if (pfd[n].revents & POLLIN)
+		{
+			while (read(w->wake[0], buf, sizeof(buf)) > 0)
+				;
+
+			/* listeners reloaded, the new set has no events yet */
+			if (__atomic_exchange_n(&w->reload, 0, __ATOMIC_SEQ_CST)) {
+				free(pfd);
+				free(ls);
+				n = accept_fds(w, &pfd, &ls);
+			}
+
+			/* a connection closed, watch the full listeners again */
+			if (worker_resume(w))
+				for (i = 0; i < n; i++)
+					if (ls[i]->off[w->id]) {
+						ls[i]->off[w->id] = 0;
+						pfd[i].fd = ls[i]->fds[w->id];
+					}
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+
+			l = ls[i];
+			if (!conn_admit(l)) {
+				/* answer the excess, or leave it queued */
+				if (conf.retry_after > 0) {
+					if ((fd = accept(pfd[i].fd, NULL, NULL)) != -1)
+						conn_shed(fd);
+					continue;
+				}
+				worker_pause(w, l);
+				pfd[i].fd = -1;
+				if (!conn_full(l) && worker_resume(w)) {
+					l->off[w->id] = 0;
+					pfd[i].fd = l->fds[w->id];
+				}
+				continue;
+			}
+
+			len = sizeof(c->ss);
+			if ((c->fd = accept(pfd[i].fd, (struct sockaddr*)&c->ss, &len)) < 0) {
+				metrics_accept(0);
+				conn_release(l);
+				continue;
+			}
+			metrics_accept(1);
+			c->l = l;
 
-		pthread_mutex_lock(&httpd_mtx);
-		CLIENT_ADD(c);
-		conf.cur_conn += 1;
-		pthread_mutex_unlock(&httpd_mtx);
+			pthread_mutex_lock(&httpd_mtx);
+			CLIENT_ADD(c);
+			c->vc = vconf_get();
+			pthread_mutex_unlock(&httpd_mtx);
 
-		if (pthread_create(&c->tid, NULL, serve, (void*)c) != 0)
-			warn("pthread_create");
+			if (pthread_create(&c->tid, NULL, serve, (void*)c) != 0)
+				warn("pthread_create");
 
-		c = client_new();
+			c = client_new();
+		}
 	}
 	return NULL;
 }
 
+/*
+ * thread engine : poll set of the listeners w watches, the wake up of
+ * a paused worker last. Return the number of listeners.
+ */
+static nfds_t
+accept_fds(struct worker *w, struct pollfd **pfdp, struct listener ***lsp)
+{
+	struct listener *l, **ls;
+	struct pollfd *pfd;
+	nfds_t n = 0;
+
+	worker_sync(w, NULL);
+
+	pthread_mutex_lock(&httpd_mtx);
+	TAILQ_FOREACH(l, &conf.list, entry)
+		n++;
+	XCALLOC(pfd, n + 1, sizeof(*pfd));
+	XCALLOC(ls, n + 1, sizeof(*ls));
+
+	n = 0;
+	TAILQ_FOREACH(l, &conf.list, entry)
+	{
+		if (!l->seen[w->id])
+			continue;
+		ls[n] = l;
+		pfd[n].fd = l->off[w->id] ? -1 : l->fds[w->id];
+		pfd[n].events = POLLIN;
+		n++;
+	}
+	pthread_mutex_unlock(&httpd_mtx);
+
+	pfd[n].fd = w->wake[0];
+	pfd[n].events = POLLIN;
+
+	*pfdp = pfd;
+	*lsp = ls;
+	return n;
+}
+
 static void *
 serve(void *arg)
 {
+	struct Client *c = arg;
+
 	if (pthread_detach(pthread_self()) != 0)
 		pthread_exit(NULL);
 
-	request_manage(arg);
+	/* blocking socket, only returns on close, error or timeout */
+	client_handle(c);
+	client_destroy(c);
 
 	return NULL;
 }
-
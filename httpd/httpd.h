@@ -1,39 +1,172 @@
 #ifndef H_HTTPD
 #define H_HTTPD
 
+#include <sys/types.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "timer.h"
+
+struct Client;
+struct uring;
+
+/* event source tags, first member of struct listener and struct Client */
+enum { EV_LISTENER, EV_CLIENT, EV_WAKE };
+
+/* socket options of a listen line, 0 for the system default */
+struct lopts {
+	size_t	max_conn;		/* connections, 0 for unlimited */
+	int		backlog;		/* conf.backlog if 0 */
+	int		defer_accept;	/* seconds to wait for data */
+	int		fastopen;		/* TFO queue length */
+	int		nodelay;
+	int		sndbuf;
+	int		rcvbuf;
+	int		keepidle;		/* SO_KEEPALIVE if set, seconds */
+	int		keepintvl;
+	int		keepcnt;
+};
+
 struct listener {
+	int						ev;		/* EV_LISTENER */
 	pthread_t				tid;
-	int 					fd;
+	int						*fds;	/* listening socket of each worker */
 	struct sockaddr_storage ss;
 	in_port_t				port;
 	int						running;
+	struct lopts			opt;
+	size_t					cur_conn;
+	char					*off;		/* not watched by a worker, full */
+	char					*seen;		/* watched by a worker (worker_sync) */
+	int						nwatch;		/* workers watching it */
+	int						gone;		/* dropped by a reload */
 	TAILQ_ENTRY(listener)	entry;
 };
 
+/*
+ * a document root, resolved and opened once, shared by the vhosts of
+ * every configuration load using it
+ */
+struct vroot {
+	struct vroot		*hnext;		/* hash chain and hash, first (vhost.c) */
+	unsigned int		hash;
+	char				*path;		/* realpath(3) of the configured one */
+	size_t				len;
+	int					fd;			/* directory descriptor */
+	dev_t				dev;		/* the directory path was when opened */
+	ino_t				ino;
+	unsigned int		refs;		/* vhosts using it */
+	int					watched;	/* below inotify (fcache.c) */
+};
+
 struct vhost {
-	char	*root;
-	char	*host;
+	struct vhost		*hnext;		/* hash chain and hash, first (vhost.c) */
+	unsigned int		hash;
+	char				*root;
+	const char			*host;		/* lower case, "*.domain" or "*", interned */
+	struct vroot		*vr;
+	struct errpage		*errors;	/* custom error pages */
+	char				*logfile;	/* access log, conf one if NULL */
+	char				*logfmt;
+	struct alog			*log;		/* compiled (alog.c) */
 	TAILQ_ENTRY(vhost)	entry;
 };
 
+struct vtable;
+struct mimetab;
+struct alog;
+
+/*
+ * vhosts of a configuration load, never changed once published. A
+ * connection keeps the one current when it was accepted.
+ */
+struct vconf {
+	unsigned int		refs;		/* conf and connections */
+	TAILQ_HEAD(, vhost)	vhosts;
+	struct vtable		*vtab;		/* lookup (vhost.c) */
+};
+
+/* one thread of the pool, owns a listening socket per listener */
+struct worker {
+	pthread_t				tid;
+	int						id;
+	int						efd;		/* epoll descriptor */
+	struct uring			*ring;		/* io_uring engine (uring.c) */
+	int						wake[2];	/* written when a connection closes */
+	int						paused;		/* listeners off, at capacity */
+	int						reload;		/* listeners changed, worker_sync() */
+	struct twheel			tw;			/* connection timeouts */
+	TAILQ_HEAD(, Client)	idle;		/* keep-alive, oldest first */
+	size_t					nidle;
+	size_t					idle_max;	/* share of max-idle, 0 unlimited */
+};
+
 struct httpd {
-	TAILQ_HEAD(, listener) list;
-	TAILQ_HEAD(, vhost) vhosts;
+	TAILQ_HEAD(, listener) list;	/* under httpd_mtx once running */
+	struct vconf *vc;			/* current vhosts, swapped under httpd_mtx */
+	const struct mimetab *mime;	/* types by extension (mime.c) */
 	struct timeval timeout;
+	time_t keepalive_timeout;	/* between requests, -1 for timeout */
+	time_t header_timeout;		/* to receive a request head */
+	time_t send_timeout;		/* without any byte sent */
+	size_t max_idle;		/* keep-alive connections, 0 unlimited */
 	char *servername;
 	char *root;
 	size_t max_conn;		/* maximum connection */
 	size_t cur_conn;		/* current connection */
+	time_t retry_after;		/* 503 beyond max-conn, 0 leaves them queued */
+	enum { ENGINE_THREAD, ENGINE_EPOLL, ENGINE_URING } engine;	/* connection engine */
+	int workers;			/* worker threads, 0 for one per cpu */
+	int backlog;			/* listen(2) backlog */
+	int affinity;			/* pin workers to cpus */
+	size_t arena_max;		/* request memory kept by a connection */
+	size_t sendfile_chunk;	/* bytes per sendfile(2) call */
+	size_t sendfile_min;	/* smaller files are copied */
+	size_t fcache_size;		/* open file cache entries, 0 disables it */
+	time_t fcache_ttl;		/* seconds an entry is trusted */
+	size_t ccache_size;		/* content cache bytes, 0 disables it */
+	size_t ccache_file_max;	/* larger files are not kept in memory */
+	int precompressed;		/* serve .gz and .br sidecars */
+	int compress;			/* gzip text types on the fly */
+	size_t compress_max;	/* larger files are sent as is */
+	size_t compress_cache;	/* bytes of compressed variants */
+	char *logfile;			/* access log, stderr if NULL, "none" */
+	char *logfmt;			/* access log format */
+	size_t log_buffer;		/* access log ring of a thread */
+	int metrics;			/* serve /metrics */
+	char *metrics_addr;		/* internal listener */
+	in_port_t metrics_port;
+	size_t max_request_line;	/* request line limit (414) */
+	size_t max_header_size;		/* request head limit (413) */
 };
 
 extern struct httpd conf;
+extern pthread_mutex_t httpd_mtx;
 
-int parse_config(const char *);
+int parse_config(const char *, struct httpd *);
+struct vconf *vconf_new(void);
+struct vconf *vconf_get(void);
+void vconf_put(struct vconf *);
+struct vhost *vhost_add(struct vconf *, char *, char *);
+struct vhost *vhost_find(const struct vconf *, const char *);
+int conn_admit(struct listener *);
+int conn_full(struct listener *);
+void conn_release(struct listener *);
+void conn_shed(int);
+void conn_stats(unsigned long *, unsigned long *);
+void worker_pause(struct worker *, struct listener *);
+int worker_resume(struct worker *);
+void worker_sync(struct worker *, void (*)(struct worker *, struct listener *, int));
+int event_init(struct worker *);
+void *event_loop(void *);
+void event_arm(struct worker *, struct Client *);
+void event_close(struct worker *, struct Client *);
+void event_expire(struct worker *);
+int uring_probe(void);
+void *uring_loop(void *);
+void uring_close(struct worker *, struct Client *);
 
 
 #endif /* H_HTTPD */
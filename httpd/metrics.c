@@ -0,0 +1,587 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Metrics : every thread counts in a block of its own, cache line
+ * aligned, with plain stores only it does, so the request path never
+ * shares a line with another thread. Latencies go in log-linear
+ * histograms per vhost (4 sub-buckets per power of two microseconds).
+ * The internal listener thread sums the blocks when scraped and
+ * answers in the Prometheus text format.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "fcache.h"
+#include "tmpl.h"
+#include "alog.h"
+#include "metrics.h"
+
+#define HIST_EMAX		27		/* last power of two, ~134s */
+#define HIST_BUCKETS	(4 * (HIST_EMAX - 1) + 1)	/* the last one unbounded */
+#define CACHE_LINE		64
+
+/* single writer counters, read by the scraper */
+#define MINC(v, n)	__atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#define MGET(v)		__atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+struct mhist {
+	const char			*host;		/* interned vhost name */
+	unsigned long		count;
+	unsigned long		sum;		/* usec */
+	unsigned long		b[HIST_BUCKETS];
+};
+
+struct mhtab {
+	struct mhist		**tab;		/* open addressing by name */
+	unsigned int		size;		/* power of 2 */
+	unsigned int		count;
+};
+
+struct mthread {
+	unsigned long		codes[STATUS_MAX];
+	unsigned long		bytes;
+	unsigned long		nsys;		/* connection i/o system calls */
+	unsigned long		opened;		/* connections */
+	unsigned long		closed;
+	unsigned long		started;	/* requests being answered */
+	unsigned long		done;
+	unsigned long		accept_errors;
+	pthread_mutex_t		mtx;		/* hists, against the scraper */
+	struct mhtab		hists;
+	struct mthread		*next;		/* every block */
+	struct mthread		*fnext;		/* blocks of exited threads */
+};
+
+static struct mthread *blocks;
+static struct mthread *pool;
+static pthread_mutex_t pool_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mt_key;
+static int msock = -1;
+static const char novhost[] = "";	/* key of requests without a vhost */
+
+static struct mthread *mthread(void);
+static void mthread_put(void *);
+static void hist_put(struct mhtab *, struct mhist *);
+static struct mhist *hist_find(struct mhtab *, const char *, int);
+static int hist_index(unsigned long);
+static unsigned long hist_bound(int);
+static void *metrics_main(void *);
+static void metrics_serve(int);
+static char *metrics_dump(size_t *);
+
+/*
+ * open the internal listener and start its thread
+ */
+void
+metrics_init(void)
+{
+	struct addrinfo hints, *res, *ai;
+	pthread_t tid;
+	const char *addr;
+	char port[8];
+	int fd, error;
+
+	if (!conf.metrics)
+		return;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%d", ntohs(conf.metrics_port));
+
+	addr = conf.metrics_addr ? conf.metrics_addr : "*";
+	if ((error = getaddrinfo(conf.metrics_addr, port, &hints, &res)) != 0) {
+		warnx("metrics %s: %s", addr, gai_strerror(error));
+		conf.metrics = 0;
+		return;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+						ai->ai_protocol)) == -1)
+			continue;
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (int[]){1},
+					sizeof(int)) == 0 &&
+				bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+				listen(fd, 16) == 0) {
+			msock = fd;
+			break;
+		}
+		close(fd);
+	}
+	freeaddrinfo(res);
+
+	if (msock == -1) {
+		warn("metrics %s port %s", addr, port);
+		conf.metrics = 0;
+		return;
+	}
+	warnx("metrics on %s port %s", addr, port);
+
+	if (pthread_key_create(&mt_key, mthread_put) != 0)
+		err(EXIT_FAILURE, "pthread_key_create");
+
+	if (pthread_create(&tid, NULL, metrics_main, NULL) != 0)
+		err(EXIT_FAILURE, "pthread_create");
+}
+
+/*
+ * outcome of an accept(2), 0 for a failure
+ */
+void
+metrics_accept(int ok)
+{
+	struct mthread *m;
+
+	if (!conf.metrics || !(m = mthread()))
+		return;
+
+	if (ok)
+		MINC(m->opened, 1);
+	else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		MINC(m->accept_errors, 1);
+}
+
+/*
+ * a request head has been parsed
+ */
+void
+metrics_start(struct Client *c)
+{
+	if (conf.metrics)
+		clock_gettime(CLOCK_MONOTONIC, &c->mstart);
+}
+
+/*
+ * the request has been answered, its response is queued
+ */
+void
+metrics_request(struct Client *c)
+{
+	struct mthread *m;
+
+	if (!conf.metrics || !(m = mthread()))
+		return;
+
+	if (c->code > 0 && c->code < STATUS_MAX)
+		MINC(m->codes[c->code], 1);
+	MINC(m->started, 1);
+}
+
+/*
+ * the response is sent, or handed to the output queue when pipelined
+ */
+void
+metrics_done(struct Client *c)
+{
+	struct mthread *m;
+	struct mhist *h;
+	struct timespec now;
+	unsigned long us;
+	int i;
+
+	if (!conf.metrics || c->mstart.tv_sec == 0 || !(m = mthread()))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - c->mstart.tv_sec) * 1000000 +
+		(now.tv_nsec - c->mstart.tv_nsec) / 1000;
+	c->mstart.tv_sec = 0;
+
+	h = hist_find(&m->hists, c->vh ? c->vh->host : novhost, 0);
+	if (!h) {
+		pthread_mutex_lock(&m->mtx);
+		h = hist_find(&m->hists, c->vh ? c->vh->host : novhost, 1);
+		pthread_mutex_unlock(&m->mtx);
+	}
+
+	i = hist_index(us);
+	MINC(h->b[i], 1);
+	MINC(h->count, 1);
+	MINC(h->sum, us);
+	MINC(m->done, 1);
+	MINC(m->bytes, c->sent - c->msent);
+	MINC(m->nsys, c->nsys - c->msys);
+	c->msent = c->sent;
+	c->msys = c->nsys;
+}
+
+void
+metrics_close(struct Client *c)
+{
+	struct mthread *m;
+
+	if (!conf.metrics || !(m = mthread()))
+		return;
+
+	/* closed in the middle of a response */
+	if (c->mstart.tv_sec != 0)
+		MINC(m->done, 1);
+	MINC(m->bytes, c->sent - c->msent);
+	MINC(m->nsys, c->nsys - c->msys);
+	MINC(m->closed, 1);
+	c->msent = c->sent;
+	c->msys = c->nsys;
+}
+
+/*
+ * block of the calling thread, one of an exited thread if any
+ */
+static struct mthread *
+mthread(void)
+{
+	struct mthread *m;
+	void *p;
+
+	if ((m = pthread_getspecific(mt_key)))
+		return m;
+
+	pthread_mutex_lock(&pool_mtx);
+	if ((m = pool))
+		pool = m->fnext;
+	pthread_mutex_unlock(&pool_mtx);
+
+	if (!m) {
+		if (posix_memalign(&p, CACHE_LINE, (sizeof(*m) + CACHE_LINE - 1) &
+					~(size_t)(CACHE_LINE - 1)) != 0)
+			return NULL;
+		m = p;
+		memset(m, 0, sizeof(*m));
+		pthread_mutex_init(&m->mtx, NULL);
+
+		/* blocks are never freed, the scraper walks them unlocked */
+		pthread_mutex_lock(&pool_mtx);
+		m->next = blocks;
+		__atomic_store_n(&blocks, m, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&pool_mtx);
+	}
+
+	pthread_setspecific(mt_key, m);
+	return m;
+}
+
+static void
+mthread_put(void *arg)
+{
+	struct mthread *m = arg;
+
+	pthread_mutex_lock(&pool_mtx);
+	m->fnext = pool;
+	pool = m;
+	pthread_mutex_unlock(&pool_mtx);
+}
+
+static void
+hist_put(struct mhtab *t, struct mhist *h)
+{
+	unsigned int i;
+
+	i = ((uintptr_t)h->host >> 4) * 2654435761u;
+	for (i &= t->size - 1; t->tab[i]; i = (i + 1) & (t->size - 1))
+		;
+	t->tab[i] = h;
+	t->count++;
+}
+
+/*
+ * histogram of host in t, added if create. The owner looks up unlocked,
+ * inserts (and grows) with the block locked. Names are interned, the
+ * same name of successive loads shares its histogram.
+ */
+static struct mhist *
+hist_find(struct mhtab *t, const char *host, int create)
+{
+	struct mhist **old, *h;
+	unsigned int i, osize;
+
+	if (t->size)
+	{
+		i = ((uintptr_t)host >> 4) * 2654435761u;
+		for (i &= t->size - 1; (h = t->tab[i]); i = (i + 1) & (t->size - 1))
+			if (h->host == host)
+				return h;
+	}
+
+	if (!create)
+		return NULL;
+
+	if (2 * (t->count + 1) > t->size)
+	{
+		old = t->tab;
+		osize = t->size;
+		t->size = osize ? 2 * osize : 16;
+		XCALLOC(t->tab, t->size, sizeof(*t->tab));
+		t->count = 0;
+		for (i = 0; i < osize; i++)
+			if (old[i])
+				hist_put(t, old[i]);
+		free(old);
+	}
+
+	XCALLOC(h, 1, sizeof(*h));
+	h->host = host;
+	hist_put(t, h);
+
+	return h;
+}
+
+/*
+ * bucket of v : exact below 4, then 4 per power of two
+ */
+static int
+hist_index(unsigned long v)
+{
+	int e;
+
+	if (v < 4)
+		return v;
+
+	e = 63 - __builtin_clzl(v);
+	if (e >= HIST_EMAX)
+		return HIST_BUCKETS - 1;
+
+	return 4 * (e - 1) + ((v >> (e - 2)) & 3);
+}
+
+/*
+ * largest value of bucket i
+ */
+static unsigned long
+hist_bound(int i)
+{
+	int e;
+
+	if (i < 4)
+		return i;
+
+	e = i / 4 + 1;
+	return ((5UL + i % 4) << (e - 2)) - 1;
+}
+
+static void *
+metrics_main(void *arg)
+{
+	int fd;
+
+	(void)arg;
+	pthread_detach(pthread_self());
+
+	for (;;)
+	{
+		if ((fd = accept(msock, NULL, NULL)) == -1)
+			continue;
+		/* a scraper not reading does not hold the thread */
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+				&(struct timeval){ 1, 0 }, sizeof(struct timeval));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+				&(struct timeval){ 1, 0 }, sizeof(struct timeval));
+		metrics_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/*
+ * one scrape per connection, GET /metrics
+ */
+static void
+metrics_serve(int fd)
+{
+	char req[4096], head[256], *body = NULL;
+	size_t len = 0, blen = 0;
+	ssize_t n;
+	int hlen;
+
+	while (len < sizeof(req) - 1)
+	{
+		if ((n = read(fd, req + len, sizeof(req) - 1 - len)) <= 0)
+			return;
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	if (!strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET /metrics?", 13))
+		body = metrics_dump(&blen);
+
+	if (body)
+		hlen = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %lu\r\nConnection: close\r\n\r\n",
+				(ulong_t)blen);
+	else
+		hlen = snprintf(head, sizeof(head), "HTTP/1.1 404 Not Found\r\n"
+				"Content-Length: 0\r\nConnection: close\r\n\r\n");
+
+	if (write(fd, head, hlen) == hlen && body)
+		for (len = 0; len < blen; len += n)
+			if ((n = write(fd, body + len, blen - len)) <= 0)
+				break;
+	free(body);
+}
+
+/*
+ * sum the thread blocks in Prometheus text format
+ */
+static char *
+metrics_dump(size_t *len)
+{
+	static unsigned long codes[STATUS_MAX];
+	struct mthread *m;
+	struct mhtab agg = { NULL, 0, 0 };
+	struct mhist *h, *a;
+	struct fcstats fst;
+	unsigned long bytes = 0, opened = 0, closed = 0, started = 0, done = 0;
+	unsigned long nsys = 0;
+	unsigned long aerr = 0, shed, pauses, cum;
+	unsigned int i;
+	int j;
+	char *buf;
+	FILE *fp;
+
+	memset(codes, 0, sizeof(codes));
+
+	for (m = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); m; m = m->next)
+	{
+		for (j = 0; j < STATUS_MAX; j++)
+			codes[j] += MGET(m->codes[j]);
+		bytes += MGET(m->bytes);
+		nsys += MGET(m->nsys);
+		opened += MGET(m->opened);
+		closed += MGET(m->closed);
+		started += MGET(m->started);
+		done += MGET(m->done);
+		aerr += MGET(m->accept_errors);
+
+		pthread_mutex_lock(&m->mtx);
+		for (i = 0; i < m->hists.size; i++)
+		{
+			if (!(h = m->hists.tab[i]))
+				continue;
+			if (!(a = hist_find(&agg, h->host, 0)))
+				a = hist_find(&agg, h->host, 1);
+			for (j = 0; j < HIST_BUCKETS; j++)
+				a->b[j] += MGET(h->b[j]);
+			a->count += MGET(h->count);
+			a->sum += MGET(h->sum);
+		}
+		pthread_mutex_unlock(&m->mtx);
+	}
+
+	fcache_stats(&fst);
+	conn_stats(&shed, &pauses);
+
+	if (!(fp = open_memstream(&buf, len)))
+		return NULL;
+
+	fprintf(fp, "# HELP httpd_requests_total Requests answered.\n"
+			"# TYPE httpd_requests_total counter\n");
+	for (j = 0; j < STATUS_MAX; j++)
+		if (codes[j])
+			fprintf(fp, "httpd_requests_total{code=\"%d\"} %lu\n", j, codes[j]);
+
+	fprintf(fp, "# HELP httpd_sent_bytes_total Bytes written to clients.\n"
+			"# TYPE httpd_sent_bytes_total counter\n"
+			"httpd_sent_bytes_total %lu\n", bytes);
+	fprintf(fp, "# HELP httpd_io_syscalls_total Reads, writes and sendfile "
+			"calls on connections.\n"
+			"# TYPE httpd_io_syscalls_total counter\n"
+			"httpd_io_syscalls_total %lu\n", nsys);
+	fprintf(fp, "# HELP httpd_io_syscalls_per_request Of the responses sent "
+			"so far.\n"
+			"# TYPE httpd_io_syscalls_per_request gauge\n"
+			"httpd_io_syscalls_per_request %.2f\n",
+			done ? (double)nsys / done : 0.0);
+	fprintf(fp, "# HELP httpd_connections Open connections.\n"
+			"# TYPE httpd_connections gauge\n"
+			"httpd_connections{state=\"active\"} %ld\n"
+			"httpd_connections{state=\"idle\"} %ld\n",
+			(long)(started - done), (long)((opened - closed) - (started - done)));
+	fprintf(fp, "# HELP httpd_accepted_total Connections accepted.\n"
+			"# TYPE httpd_accepted_total counter\n"
+			"httpd_accepted_total %lu\n", opened);
+	fprintf(fp, "# HELP httpd_accept_errors_total Failed accept(2).\n"
+			"# TYPE httpd_accept_errors_total counter\n"
+			"httpd_accept_errors_total %lu\n", aerr);
+	fprintf(fp, "# HELP httpd_shed_total Connections answered 503 at capacity.\n"
+			"# TYPE httpd_shed_total counter\n"
+			"httpd_shed_total %lu\n", shed);
+	fprintf(fp, "# HELP httpd_admission_pauses_total Listeners left unwatched "
+			"at capacity.\n"
+			"# TYPE httpd_admission_pauses_total counter\n"
+			"httpd_admission_pauses_total %lu\n", pauses);
+	fprintf(fp, "# HELP httpd_fcache_lookups_total Open file cache lookups.\n"
+			"# TYPE httpd_fcache_lookups_total counter\n"
+			"httpd_fcache_lookups_total{result=\"hit\"} %lu\n"
+			"httpd_fcache_lookups_total{result=\"miss\"} %lu\n",
+			fst.hits, fst.misses);
+	fprintf(fp, "# TYPE httpd_fcache_entries gauge\n"
+			"httpd_fcache_entries %lu\n", fst.entries);
+	fprintf(fp, "# TYPE httpd_fcache_evictions_total counter\n"
+			"httpd_fcache_evictions_total %lu\n", fst.evictions);
+	fprintf(fp, "# TYPE httpd_fcache_invalidations_total counter\n"
+			"httpd_fcache_invalidations_total %lu\n", fst.invalidations);
+	fprintf(fp, "# HELP httpd_ccache_lookups_total Content cache lookups.\n"
+			"# TYPE httpd_ccache_lookups_total counter\n"
+			"httpd_ccache_lookups_total{result=\"hit\"} %lu\n"
+			"httpd_ccache_lookups_total{result=\"miss\"} %lu\n",
+			fst.chits, fst.cmisses);
+	fprintf(fp, "# TYPE httpd_ccache_bytes gauge\n"
+			"httpd_ccache_bytes %lu\n", fst.cbytes);
+	fprintf(fp, "# TYPE httpd_ccache_evictions_total counter\n"
+			"httpd_ccache_evictions_total %lu\n", fst.cevictions);
+	fprintf(fp, "# HELP httpd_log_dropped_total Access log entries dropped.\n"
+			"# TYPE httpd_log_dropped_total counter\n"
+			"httpd_log_dropped_total %lu\n", alog_dropped());
+
+	fprintf(fp, "# HELP httpd_request_duration_seconds From the parsed "
+			"request to its sent response.\n"
+			"# TYPE httpd_request_duration_seconds histogram\n");
+	for (i = 0; i < agg.size; i++)
+	{
+		if (!(a = agg.tab[i]))
+			continue;
+		/* the overflow bucket is only in +Inf */
+		for (cum = 0, j = 0; j < HIST_BUCKETS - 1; j++) {
+			cum += a->b[j];
+			fprintf(fp, "httpd_request_duration_seconds_bucket"
+					"{vhost=\"%s\",le=\"%.6f\"} %lu\n",
+					a->host, hist_bound(j) / 1e6, cum);
+		}
+		fprintf(fp, "httpd_request_duration_seconds_bucket"
+				"{vhost=\"%s\",le=\"+Inf\"} %lu\n"
+				"httpd_request_duration_seconds_sum{vhost=\"%s\"} %.6f\n"
+				"httpd_request_duration_seconds_count{vhost=\"%s\"} %lu\n",
+				a->host, a->count, a->host, a->sum / 1e6, a->host, a->count);
+		free(a);
+	}
+	free(agg.tab);
+
+	fclose(fp);
+	return buf;
+}
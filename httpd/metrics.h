@@ -0,0 +1,13 @@
+#ifndef H_METRICS
+#define H_METRICS
+
+struct Client;
+
+void metrics_init(void);
+void metrics_accept(int);
+void metrics_start(struct Client *);
+void metrics_request(struct Client *);
+void metrics_done(struct Client *);
+void metrics_close(struct Client *);
+
+#endif /* H_METRICS */
@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * MIME types by extension. The built-in table is hashed at compile time
+ * by mimegen, a types file at load time, both with mime_build().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <err.h>
+
+#include "mime.h"
+
+#define DISP_MAX	(1 << 20)	/* seeds tried for a bucket */
+
+struct bucket {
+	unsigned int	n;
+	size_t			*keys;
+};
+
+static int bucket_cmp(const void *, const void *);
+static int mime_place(struct mime *, struct bucket *, unsigned int, unsigned int,
+		unsigned int *, struct mime *);
+
+/* FNV-1a of the lower case extension, seeded */
+unsigned int
+mime_hash(const char *ext, unsigned int seed)
+{
+	unsigned int h = 2166136261u ^ (seed * 16777619u);
+
+	for (; *ext; ext++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*ext)) * 16777619u;
+
+	return h ^ (h >> 15);
+}
+
+static int
+bucket_cmp(const void *a, const void *b)
+{
+	return ((const struct bucket *)b)->n - ((const struct bucket *)a)->n;
+}
+
+/*
+ * build t from the n entries of m, the last of duplicate extensions wins.
+ * Return -1 on failure.
+ */
+int
+mime_build(struct mime *m, size_t n, struct mimetab *t)
+{
+	struct bucket *b, *order;
+	struct mime *slots;
+	unsigned int *disp;
+	unsigned int nb, size;
+	size_t i, j, k;
+	int done;
+
+	/* drop the overridden duplicates */
+	for (i = k = 0; i < n; i++)
+	{
+		for (j = i + 1; j < n; j++)
+			if (!strcasecmp(m[i].ext, m[j].ext))
+				break;
+		if (j == n)
+			m[k++] = m[i];
+	}
+	n = k;
+
+	nb = n / 4 + 1;
+	for (size = 8; size < n + n / 4; size *= 2)
+		;
+
+	for (;; size *= 2)
+	{
+		if (!(b = calloc(nb, sizeof(*b))) ||
+				!(order = calloc(nb, sizeof(*order))) ||
+				!(disp = calloc(nb, sizeof(*disp))) ||
+				!(slots = calloc(size, sizeof(*slots))))
+			err(1, "calloc");
+
+		for (i = 0; i < n; i++) {
+			k = mime_hash(m[i].ext, 0) % nb;
+			if (!(b[k].keys = realloc(b[k].keys, (b[k].n + 1) * sizeof(size_t))))
+				err(1, "realloc");
+			b[k].keys[b[k].n++] = i;
+		}
+
+		/* largest buckets first, while the table is empty */
+		memcpy(order, b, nb * sizeof(*b));
+		qsort(order, nb, sizeof(*order), bucket_cmp);
+
+		for (i = 0, done = 1; i < nb && order[i].n; i++)
+		{
+			k = mime_hash(m[order[i].keys[0]].ext, 0) % nb;
+			if (mime_place(m, &order[i], size - 1, k, disp, slots) == -1) {
+				done = 0;
+				break;
+			}
+		}
+
+		for (j = 0; j < nb; j++)
+			free(b[j].keys);
+		free(b);
+		free(order);
+
+		if (done)
+			break;
+
+		/* no seed for a bucket, retry with a sparser table */
+		free(disp);
+		free(slots);
+		if (size > n * 64)
+			return -1;
+	}
+
+	t->nb = nb;
+	t->mask = size - 1;
+	t->disp = disp;
+	t->slots = slots;
+	t->count = n;
+
+	return 0;
+}
+
+/*
+ * find the first seed sending every key of bucket b to a free slot
+ */
+static int
+mime_place(struct mime *m, struct bucket *b, unsigned int mask, unsigned int k,
+		unsigned int *disp, struct mime *slots)
+{
+	unsigned int d, s, i, j;
+	unsigned int pos[b->n];
+
+	for (d = 1; d < DISP_MAX; d++)
+	{
+		for (i = 0; i < b->n; i++)
+		{
+			s = mime_hash(m[b->keys[i]].ext, d) & mask;
+			if (slots[s].ext)
+				break;
+			for (j = 0; j < i; j++)
+				if (pos[j] == s)
+					break;
+			if (j < i)
+				break;
+			pos[i] = s;
+		}
+
+		if (i == b->n) {
+			for (i = 0; i < b->n; i++)
+				slots[pos[i]] = m[b->keys[i]];
+			disp[k] = d;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*
+ * type of extension ext, NULL if unknown
+ */
+const char *
+mime_lookup(const struct mimetab *t, const char *ext)
+{
+	const struct mime *e;
+	unsigned int d;
+
+	d = t->disp[mime_hash(ext, 0) % t->nb];
+	e = &t->slots[mime_hash(ext, d) & t->mask];
+
+	if (e->ext && !strcasecmp(e->ext, ext))
+		return e->type;
+	return NULL;
+}
+
+/*
+ * build t from the entries of base and those of the mime.types(5) like
+ * file, "type ext ...", the file wins. Return -1 on failure.
+ */
+int
+mime_load(const char *file, const struct mimetab *base, struct mimetab *t)
+{
+	FILE *fp;
+	struct mime *m = NULL;
+	size_t n = 0, size = 0, i;
+	char *line = NULL, *p, *type, *ext;
+	size_t len = 0;
+	int ret;
+
+	if (!(fp = fopen(file, "r")))
+		return -1;
+
+	for (i = 0; i <= base->mask; i++)
+	{
+		if (!base->slots[i].ext)
+			continue;
+		if (n == size && !(m = realloc(m, (size = size * 2 + 256) * sizeof(*m))))
+			err(1, "realloc");
+		m[n++] = base->slots[i];
+	}
+
+	while (getline(&line, &len, fp) != -1)
+	{
+		if ((p = strchr(line, '#')))
+			*p = '\0';
+
+		p = line;
+		if (!(type = strsep(&p, " \t\r\n")) || !*type)
+			continue;
+		if (!(type = strdup(type)))
+			err(1, "strdup");
+
+		while ((ext = strsep(&p, " \t\r\n")))
+		{
+			if (!*ext)
+				continue;
+			if (n == size && !(m = realloc(m, (size = size * 2 + 256) * sizeof(*m))))
+				err(1, "realloc");
+			if (!(m[n].ext = strdup(ext)))
+				err(1, "strdup");
+			m[n++].type = type;
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	ret = mime_build(m, n, t);
+	free(m);
+
+	return ret;
+}
@@ -0,0 +1,31 @@
+#ifndef H_MIME
+#define H_MIME
+
+#include <stddef.h>
+
+struct mime {
+	const char		*ext;
+	const char		*type;
+};
+
+/*
+ * perfect hash of extensions (hash and displace) : an extension goes to
+ * bucket mime_hash(ext, 0) % nb, then to slot mime_hash(ext, disp[bucket])
+ * of a table where no other extension lives
+ */
+struct mimetab {
+	unsigned int		nb;			/* buckets */
+	unsigned int		mask;		/* slots - 1 */
+	const unsigned int	*disp;		/* seed of each bucket */
+	const struct mime	*slots;		/* ext NULL if empty */
+	size_t				count;
+};
+
+extern const struct mimetab mime_default;	/* mime_types.h, mime_table.c */
+
+unsigned int mime_hash(const char *, unsigned int);
+int mime_build(struct mime *, size_t, struct mimetab *);
+const char *mime_lookup(const struct mimetab *, const char *);
+int mime_load(const char *, const struct mimetab *, struct mimetab *);
+
+#endif /* H_MIME */
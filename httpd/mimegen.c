@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * build time : hash mime_types.h and print it as mime_table.c
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "mime.h"
+
+static struct mime m_type[] = {
+#include "mime_types.h"
+};
+
+int
+main(void)
+{
+	struct mimetab t;
+	unsigned int i;
+
+	if (mime_build(m_type, sizeof(m_type) / sizeof(*m_type), &t) == -1)
+		errx(1, "mime_types.h: no perfect hash found");
+
+	printf("/* generated by mimegen from mime_types.h, do not edit */\n\n");
+	printf("#include \"mime.h\"\n\n");
+
+	printf("static const unsigned int disp[%u] = {", t.nb);
+	for (i = 0; i < t.nb; i++)
+		printf("%s%u,", (i % 12) ? " " : "\n\t", t.disp[i]);
+	printf("\n};\n\n");
+
+	printf("static const struct mime slots[%u] = {\n", t.mask + 1);
+	for (i = 0; i <= t.mask; i++)
+		if (t.slots[i].ext)
+			printf("\t[%u] = { \"%s\", \"%s\" },\n", i, t.slots[i].ext,
+					t.slots[i].type);
+	printf("};\n\n");
+
+	printf("const struct mimetab mime_default = {\n"
+			"\t%u, %u, disp, slots, %zu\n};\n", t.nb, t.mask, t.count);
+
+	return 0;
+}
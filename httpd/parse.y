@@ -39,6 +39,8 @@
 #include "parse.h"
 #include "stack.h"
 #include "httpd.h"
+#include "mime.h"
+#include "tmpl.h"
 
 struct listener *host_v4(const char *, in_port_t);
 struct listener *host_v6(const char *, in_port_t);
@@ -51,23 +53,32 @@ static int  yyerror(const char *, ...);
 
 /* variables */
 YYSTYPE yylval;
+extern FILE *yyin;
+void yyrestart(FILE *);
+static struct httpd *cf;		/* configuration being loaded */
+static struct vhost *curvh;		/* host line being parsed */
+static struct lopts lopt;		/* options of the listen line */
+
+static void listen_opts(struct listener *);
 
 %}
 
 %token LISTEN ON ALL PORT
-%token HOST ROOT LF SET
+%token HOST ROOT LF SET TYPES ERRORPAGE LOG FORMAT METRICS
 %token <v.s> STRING
 %token <v.n> NUMBER
 
 %type <v.n> port
-%type <v.s> on
+%type <v.s> on maddr
 
 %%
 grammar : /* empty */
 		| grammar LF
 		| grammar main LF
 		| grammar host LF
+		| grammar metrics LF
 		| grammar set LF
+		| grammar types LF
 		;
 
 port	: PORT STRING {
@@ -90,7 +101,9 @@ port	: PORT STRING {
 		}
 		;
 
-main	: LISTEN on port {
+main	: LISTEN on port lopts {
+			struct listener *prev = TAILQ_FIRST(&cf->list);
+
 			if ($2 == NULL) {
 				if (host("0.0.0.0", $3) <= 0 || host("::", $3) <= 0) {
 					yyerror("invalid virtual ip or interface: %s", $2);
@@ -103,6 +116,54 @@ main	: LISTEN on port {
 					YYERROR;
 				}
 			}
+			listen_opts(prev);
+		}
+		;
+
+lopts	: /* empty */ {
+			memset(&lopt, 0, sizeof(lopt));
+		}
+		| lopts STRING NUMBER {
+			if (!strcmp($2, "max-conn")) {
+				lopt.max_conn = $3;
+			}
+			else if (!strcmp($2, "backlog")) {
+				lopt.backlog = $3;
+			}
+			else if (!strcmp($2, "defer-accept")) {
+				lopt.defer_accept = $3;
+			}
+			else if (!strcmp($2, "fastopen")) {
+				lopt.fastopen = $3;
+			}
+			else if (!strcmp($2, "sndbuf")) {
+				lopt.sndbuf = $3;
+			}
+			else if (!strcmp($2, "rcvbuf")) {
+				lopt.rcvbuf = $3;
+			}
+			else if (!strcmp($2, "keepalive")) {
+				lopt.keepidle = $3;
+			}
+			else if (!strcmp($2, "keepalive-interval")) {
+				lopt.keepintvl = $3;
+			}
+			else if (!strcmp($2, "keepalive-count")) {
+				lopt.keepcnt = $3;
+			}
+			else {
+				yyerror("unknown listen option %s", $2);
+				YYERROR;
+			}
+		}
+		| lopts STRING {
+			if (!strcmp($2, "nodelay")) {
+				lopt.nodelay = 1;
+			}
+			else {
+				yyerror("unknown listen option %s", $2);
+				YYERROR;
+			}
 		}
 		;
 
@@ -117,32 +178,140 @@ on		: ON STRING {
 		}
 		;
 
+metrics	: METRICS maddr PORT NUMBER {
+			if ($4 <= 0 || $4 >= (int)USHRT_MAX) {
+				yyerror("metrics port %lld is invalid", $4);
+				YYERROR;
+			}
+			cf->metrics = 1;
+			cf->metrics_addr = $2;
+			cf->metrics_port = htons($4);
+		}
+		;
+
+maddr	: ON STRING {
+			$$ = $2;
+		}
+		| ON ALL {
+			$$ = NULL;
+		}
+		| /* empty */ {
+			$$ = strdup("127.0.0.1");
+		}
+		;
+
 host	: HOST STRING ROOT STRING /* TODO listening on specific addr */
 	 	{
-			struct stat st;
-			struct vhost *vh;
+			if (!(curvh = vhost_add(cf->vc, $2, $4))) {
+				yyerror("host %s root %s: %s", $2, $4, strerror(errno));
+				YYERROR;
+			}
+		} hostopts
+		;
 
-			if (stat($4, &st) == -1) {
-				yyerror("%s: %s", $4, strerror(errno));
+hostopts : /* empty */
+		| hostopts ERRORPAGE NUMBER STRING {
+			struct errpage *ep;
+
+			if (!(ep = errpage_load($3, $4))) {
+				yyerror("error %d %s: %s", $3, $4, strerror(errno));
 				YYERROR;
 			}
-			if (!S_ISDIR(st.st_mode)) {
-				yyerror("%s: not a directory", $4);
+			ep->next = curvh->errors;
+			curvh->errors = ep;
+		}
+		| hostopts LOG STRING {
+			curvh->logfile = $3;
+		}
+		| hostopts FORMAT STRING {
+			curvh->logfmt = $3;
+		}
+		;
+
+types	: TYPES STRING {
+			struct mimetab *t;
+
+			XMALLOC(t, sizeof(*t));
+			if (mime_load($2, cf->mime, t) == -1) {
+				yyerror("types %s: %s", $2, strerror(errno));
+				free(t);
 				YYERROR;
 			}
-			XMALLOC(vh, sizeof(*vh));
-			vh->host = $2;
-			vh->root = $4;
-			TAILQ_INSERT_HEAD(&conf.vhosts, vh, entry);
+			cf->mime = t;
 		}
 		;
 
 set		: SET STRING NUMBER {
 			if (!strcmp($2, "timeout")) {
-				conf.timeout.tv_sec = $3;
+				cf->timeout.tv_sec = $3;
+			}
+			else if (!strcmp($2, "keepalive-timeout")) {
+				cf->keepalive_timeout = $3;
+			}
+			else if (!strcmp($2, "header-timeout")) {
+				cf->header_timeout = $3;
+			}
+			else if (!strcmp($2, "send-timeout")) {
+				cf->send_timeout = $3;
+			}
+			else if (!strcmp($2, "max-idle")) {
+				cf->max_idle = $3;
 			}
 			else if (!strcmp($2, "max-conn")) {
-				conf.max_conn = $3;
+				cf->max_conn = $3;
+			}
+			else if (!strcmp($2, "retry-after")) {
+				cf->retry_after = $3;
+			}
+			else if (!strcmp($2, "workers")) {
+				if ($3 < 1) {
+					yyerror("workers must be at least 1");
+					YYERROR;
+				}
+				cf->workers = $3;
+			}
+			else if (!strcmp($2, "backlog")) {
+				cf->backlog = $3;
+			}
+			else if (!strcmp($2, "arena-max")) {
+				cf->arena_max = $3;
+			}
+			else if (!strcmp($2, "sendfile-chunk")) {
+				if ($3 < 1) {
+					yyerror("sendfile-chunk must be positive");
+					YYERROR;
+				}
+				cf->sendfile_chunk = $3;
+			}
+			else if (!strcmp($2, "sendfile-min")) {
+				cf->sendfile_min = $3;
+			}
+			else if (!strcmp($2, "fcache-size")) {
+				cf->fcache_size = $3;
+			}
+			else if (!strcmp($2, "fcache-ttl")) {
+				cf->fcache_ttl = $3;
+			}
+			else if (!strcmp($2, "ccache-size")) {
+				cf->ccache_size = $3;
+			}
+			else if (!strcmp($2, "ccache-file-max")) {
+				cf->ccache_file_max = $3;
+			}
+			else if (!strcmp($2, "compress-max")) {
+				cf->compress_max = $3;
+			}
+			else if (!strcmp($2, "compress-cache")) {
+				cf->compress_cache = $3;
+			}
+			else if (!strcmp($2, "log-buffer")) {
+				cf->log_buffer = $3;
+			}
+			else if (!strcmp($2, "max-request-line")) {
+				cf->max_request_line = $3;
+			}
+			else if (!strcmp($2, "max-header-size")) {
+				cf->max_header_size = $3;
 			}
 			else {
 				yyerror("%s: not a valid server param", $2);
@@ -151,7 +320,55 @@ set		: SET STRING NUMBER {
 		}
 		| SET STRING STRING {
 			if (!strcmp($2, "servername")) {
-				conf.servername = $3;
+				cf->servername = $3;
+			}
+			else if (!strcmp($2, "access-log")) {
+				cf->logfile = $3;
+			}
+			else if (!strcmp($2, "log-format")) {
+				cf->logfmt = $3;
+			}
+			else if (!strcmp($2, "cpu-affinity")) {
+				if (!strcmp($3, "yes"))
+					cf->affinity = 1;
+				else if (!strcmp($3, "no"))
+					cf->affinity = 0;
+				else {
+					yyerror("cpu-affinity: yes or no");
+					YYERROR;
+				}
+			}
+			else if (!strcmp($2, "precompressed")) {
+				if (!strcmp($3, "yes"))
+					cf->precompressed = 1;
+				else if (!strcmp($3, "no"))
+					cf->precompressed = 0;
+				else {
+					yyerror("precompressed: yes or no");
+					YYERROR;
+				}
+			}
+			else if (!strcmp($2, "compress")) {
+				if (!strcmp($3, "yes"))
+					cf->compress = 1;
+				else if (!strcmp($3, "no"))
+					cf->compress = 0;
+				else {
+					yyerror("compress: yes or no");
+					YYERROR;
+				}
+			}
+			else if (!strcmp($2, "engine")) {
+				if (!strcmp($3, "thread"))
+					cf->engine = ENGINE_THREAD;
+				else if (!strcmp($3, "epoll"))
+					cf->engine = ENGINE_EPOLL;
+				else if (!strcmp($3, "uring"))
+					cf->engine = ENGINE_URING;
+				else {
+					yyerror("%s: unknown engine", $3);
+					YYERROR;
+				}
 			}
 			else {
 				yyerror("%s: not a valid server param", $2);
@@ -175,38 +392,78 @@ yyerror(const char *fmt, ...)
     return 0;
 }
 
+/*
+ * load filename into c, its listeners and a new vhost snapshot. The
+ * running configuration is not touched, a reload parses into a copy.
+ */
 int
-parse_config(const char *filename)
+parse_config(const char *filename, struct httpd *c)
 {
-	int fd;
-
-	if ((fd = open(filename, O_RDONLY)) == -1)
-		err(1, "%s", filename);
+	FILE *fp;
 
 	/* init conf */
-	TAILQ_INIT(&conf.list);
-	TAILQ_INIT(&conf.vhosts);
-	conf.timeout.tv_sec = 10;
-	conf.timeout.tv_usec = 0;
-	conf.servername = NULL;
-	conf.max_conn = -1;
-	conf.cur_conn = 0;
-
+	cf = c;
+	TAILQ_INIT(&cf->list);
+	cf->vc = vconf_new();
+	cf->mime = &mime_default;
+	cf->timeout.tv_sec = 10;
+	cf->timeout.tv_usec = 0;
+	cf->keepalive_timeout = -1;
+	cf->header_timeout = -1;
+	cf->send_timeout = -1;
+	cf->max_idle = 0;
+	cf->servername = NULL;
+	cf->max_conn = -1;
+	cf->cur_conn = 0;
+	cf->retry_after = 0;
+	cf->engine = ENGINE_THREAD;
+	cf->workers = 0;
+	cf->backlog = 128;
+	cf->affinity = 0;
+	cf->arena_max = 16 * ARENA_BLOCK;
+	cf->sendfile_chunk = 512 * 1024;
+	cf->sendfile_min = 16 * 1024;
+	cf->fcache_size = 1024;
+	cf->fcache_ttl = 60;
+	cf->ccache_size = 0;
+	cf->ccache_file_max = 32 * 1024;
+	cf->precompressed = 1;
+	cf->compress = 0;
+	cf->compress_max = 1024 * 1024;
+	cf->compress_cache = 16 * 1024 * 1024;
+	cf->logfile = NULL;
+	cf->logfmt = "%h - - %t \"%r\" %s %b";
+	cf->log_buffer = 64 * 1024;
+	cf->max_request_line = 8192;
+	cf->max_header_size = 65536;
+
+	if (!(fp = fopen(filename, "r"))) {
+		warn("%s", filename);
+		return -1;
+	}
 	file.name = filename;
 	file.lineno = 1;
 	file.error = 0;
 
-	if (close(STDIN_FILENO) == -1)
-		err(1, "stdin");
+	yyin = fp;
+	yyrestart(fp);
+	yyparse();
+	fclose(fp);
 
-	if (dup(fd) == -1)
-		err(1, "%s", filename); 
+	/* unset timeouts follow set timeout */
+	if (cf->keepalive_timeout < 0)
+		cf->keepalive_timeout = cf->timeout.tv_sec;
+	if (cf->header_timeout < 0)
+		cf->header_timeout = cf->timeout.tv_sec;
+	if (cf->send_timeout < 0)
+		cf->send_timeout = cf->timeout.tv_sec;
 
-	yyparse();
-	close(fd);
+	if (!cf->servername)
+		XSTRDUP(cf->servername, "OpenHTTPD/"HTTPD_VERSION);
 
-	if (!conf.servername)
-		XSTRDUP(conf.servername, "OpenHTTPD/"HTTPD_VERSION);
+	/* variants are only compressed once in cached entries */
+	if (cf->compress && cf->fcache_size == 0)
+		yyerror("compress: needs fcache-size");
 
 	return file.error;
 }
@@ -303,13 +560,26 @@ host_dns(const char *s, in_port_t port)
 			sin6->sin6_port = port;
 		}
 
-		TAILQ_INSERT_HEAD(&conf.list, h, entry);
+		TAILQ_INSERT_HEAD(&cf->list, h, entry);
 		cnt++;
 	}
 	freeaddrinfo(res0);
 	return (cnt);
 }
 
+/*
+ * options of the listen line on the listeners it added, the ones
+ * before prev
+ */
+static void
+listen_opts(struct listener *prev)
+{
+	struct listener *l;
+
+	for (l = TAILQ_FIRST(&cf->list); l && l != prev; l = TAILQ_NEXT(l, entry))
+		l->opt = lopt;
+}
+
 int
 host(const char *s, in_port_t port)
 {
@@ -323,7 +593,7 @@ host(const char *s, in_port_t port)
 
 	if (h != NULL) {
 		h->port = port;
-		TAILQ_INSERT_HEAD(&conf.list, h, entry);
+		TAILQ_INSERT_HEAD(&cf->list, h, entry);
 		return (1);
 	}
 
@@ -371,10 +641,9 @@ interface(const char *s, in_port_t port)
 				continue;
 		}
 
-		h->fd = -1;
 		h->port = port;
 		ret = 1;
-		TAILQ_INSERT_HEAD(&conf.list, h, entry);
+		TAILQ_INSERT_HEAD(&cf->list, h, entry);
 	}
 
 	freeifaddrs(ifap);
@@ -6,10 +6,7 @@
 #include <sys/queue.h>
 #include <err.h>
 
-typedef struct Stack {
-	void *adr;
-	SLIST_ENTRY(Stack) next;
-} Stack;
+#include "arena.h"
 
 /* usefull macros */
 #define XMALLOC(ptr, size)					\
@@ -36,22 +33,20 @@ typedef struct Stack {
 			err(EXIT_FAILURE, "realloc");   \
 	} while (0)
 
+/* per request memory, released when the request is over */
 #define ZMALLOC(c, ptr, size)				\
 	do {									\
-		XMALLOC(ptr, size);					\
-		mstack_push(c, ptr);				\
+		ptr = arena_alloc(&(c)->mem, size);	\
 	} while (0)
 
 #define ZCALLOC(c, elm, n, size)			\
 	do {									\
-		XCALLOC(elm, n, size);				\
-		mstack_push(c, elm);				\
+		elm = arena_calloc(&(c)->mem, n, size);	\
 	} while (0)
 
 #define ZSTRDUP(c, dst, src)				\
 	do {									\
-		XSTRDUP(dst, src);					\
-		mstack_push(c, dst);				\
+		dst = arena_strdup(&(c)->mem, src);	\
 	} while (0)
 
 
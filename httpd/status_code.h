@@ -32,6 +32,7 @@
 { 415,	"Unsupported Media Type" },
 { 416,	"Requested range not satisfiable" },
 { 417,	"Expectation Failed" },
+{ 431,	"Request Header Fields Too Large" },
 { 500,	"Internal Server Error" },
 { 501,	"Not Implemented" },
 { 502,	"Bad Gateway" },
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Timing wheel : a timer sits in the slot of its expiry tick at the
+ * lowest level where it shares the block of the current tick, adding
+ * and removing are O(1). Crossing a block boundary moves the timers
+ * of the next slot of the level above down, each is moved at most
+ * once per level.
+ */
+
+#include <time.h>
+
+#include "timer.h"
+
+#define LEVEL_SHIFT(l)	((l) * TIMER_BITS)
+
+static void timer_put(struct twheel *, struct timer *);
+
+void
+timer_init(struct twheel *tw, uint64_t now)
+{
+	int l, i;
+
+	tw->now = now;
+	tw->count = 0;
+	for (l = 0; l < TIMER_LEVELS; l++)
+		for (i = 0; i < TIMER_SLOTS; i++)
+			LIST_INIT(&tw->slots[l][i]);
+}
+
+/*
+ * arm t to fire in ticks, from the last processed tick
+ */
+void
+timer_add(struct twheel *tw, struct timer *t, uint64_t ticks)
+{
+	if (t->pending)
+		timer_del(tw, t);
+
+	/* not advanced while empty */
+	if (tw->count == 0)
+		tw->now = timer_ticks();
+
+	/* the current slot is already processed */
+	if (ticks < 1)
+		ticks = 1;
+	if (ticks >= (uint64_t)1 << LEVEL_SHIFT(TIMER_LEVELS))
+		ticks = ((uint64_t)1 << LEVEL_SHIFT(TIMER_LEVELS)) - 1;
+
+	t->expire = tw->now + ticks;
+	t->pending = 1;
+	tw->count++;
+	timer_put(tw, t);
+}
+
+void
+timer_del(struct twheel *tw, struct timer *t)
+{
+	if (!t->pending)
+		return;
+
+	LIST_REMOVE(t, entry);
+	t->pending = 0;
+	tw->count--;
+}
+
+/*
+ * next timer expired at tick now, NULL once every one was returned
+ */
+struct timer *
+timer_expired(struct twheel *tw, uint64_t now)
+{
+	struct tslot *s, tmp;
+	struct timer *t;
+	int l, i;
+
+	for (;;)
+	{
+		s = &tw->slots[0][tw->now & (TIMER_SLOTS - 1)];
+		if ((t = LIST_FIRST(s))) {
+			timer_del(tw, t);
+			return t;
+		}
+
+		if (tw->now >= now)
+			return NULL;
+
+		/* nothing armed, skip the idle ticks */
+		if (tw->count == 0) {
+			tw->now = now;
+			return NULL;
+		}
+
+		tw->now++;
+
+		/* entering a new block of a level, move its timers down */
+		for (l = 1; l < TIMER_LEVELS; l++)
+		{
+			if (tw->now & ((1 << LEVEL_SHIFT(l)) - 1))
+				break;
+			i = (tw->now >> LEVEL_SHIFT(l)) & (TIMER_SLOTS - 1);
+			LIST_INIT(&tmp);
+			while ((t = LIST_FIRST(&tw->slots[l][i]))) {
+				LIST_REMOVE(t, entry);
+				LIST_INSERT_HEAD(&tmp, t, entry);
+			}
+			while ((t = LIST_FIRST(&tmp))) {
+				LIST_REMOVE(t, entry);
+				timer_put(tw, t);
+			}
+		}
+	}
+}
+
+/*
+ * monotonic clock in ticks
+ */
+uint64_t
+timer_ticks(void)
+{
+	struct timespec ts;
+
+#if defined (CLOCK_MONOTONIC_COARSE)
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK;
+}
+
+static void
+timer_put(struct twheel *tw, struct timer *t)
+{
+	int l;
+
+	for (l = 0; l < TIMER_LEVELS - 1; l++)
+		if ((t->expire >> LEVEL_SHIFT(l + 1)) == (tw->now >> LEVEL_SHIFT(l + 1)))
+			break;
+
+	LIST_INSERT_HEAD(&tw->slots[l][(t->expire >> LEVEL_SHIFT(l)) &
+			(TIMER_SLOTS - 1)], t, entry);
+}
@@ -0,0 +1,34 @@
+#ifndef H_TIMER
+#define H_TIMER
+
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define TIMER_BITS		6
+#define TIMER_SLOTS		(1 << TIMER_BITS)
+#define TIMER_LEVELS	4		/* 2^24 ticks */
+#define TIMER_TICK		250		/* ms */
+
+struct timer {
+	LIST_ENTRY(timer)	entry;
+	uint64_t			expire;		/* tick */
+	int					pending;
+	void				*arg;
+};
+
+LIST_HEAD(tslot, timer);
+
+/* hierarchical timing wheel, one per event loop, not locked */
+struct twheel {
+	uint64_t		now;		/* last tick processed */
+	size_t			count;		/* pending timers */
+	struct tslot	slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_init(struct twheel *, uint64_t);
+void timer_add(struct twheel *, struct timer *, uint64_t);
+void timer_del(struct twheel *, struct timer *);
+struct timer *timer_expired(struct twheel *, uint64_t);
+uint64_t timer_ticks(void);
+
+#endif /* H_TIMER */
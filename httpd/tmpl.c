@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Response templates : the constant part of every response head is
+ * built once per status code, a response only copies it and patches
+ * the Date slot. File headers are built once per cache entry (fcache.c),
+ * error bodies once per code or per vhost page.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "tmpl.h"
+
+#define ERROR_BODY	"<h1 style=\"text-align: center;\">%d - %s</h1>"
+
+static struct st_code {
+	int code;
+	char *msg;
+} status_code[] = {
+#include "status_code.h"
+};
+
+static struct tmpl tmpls[STATUS_MAX];
+static const char *messages[STATUS_MAX];		/* direct index of status_code */
+static struct errpage errors[STATUS_MAX];
+
+static void errpage_head(struct errpage *, const char *);
+
+void
+tmpl_init(void)
+{
+	struct st_code *st;
+	struct tmpl *t;
+	struct errpage *e;
+	int n;
+
+	/* first publication of the clock, before any worker */
+	date_now();
+
+	for (st = status_code; st->code != 0; st++)
+	{
+		messages[st->code] = st->msg;
+
+		t = &tmpls[st->code];
+		free(t->data);
+
+		n = asprintf(&t->data, "HTTP/1.1 %d %s\r\nServer: %s\r\nDate: %*s\r\n",
+				st->code, st->msg, conf.servername, DATE_LEN, "");
+		if (n == -1)
+			err(EXIT_FAILURE, "asprintf");
+
+		t->len = n;
+		t->date = n - DATE_LEN - 2;
+
+		/* default error page */
+		if (st->code < 300 && st->code != 101)
+			continue;
+		e = &errors[st->code];
+		free(e->hdrs);
+		free(e->body);
+		e->code = st->code;
+		if ((n = asprintf(&e->body, ERROR_BODY, st->code, st->msg)) == -1)
+			err(EXIT_FAILURE, "asprintf");
+		e->blen = n;
+		errpage_head(e, "text/html");
+	}
+}
+
+/*
+ * Content-Type and Content-Length lines of e, and the upgrade
+ * requested by a protocol error
+ */
+static void
+errpage_head(struct errpage *e, const char *type)
+{
+	int n;
+
+	n = asprintf(&e->hdrs, "Content-Type: %s\r\nContent-Length: %lu\r\n%s", type,
+			(ulong_t)e->blen, (e->code == 101 || e->code == 505) ?
+			"Upgrade: HTTP/1.1\r\n" : "");
+	if (n == -1)
+		err(EXIT_FAILURE, "asprintf");
+	e->hlen = n;
+}
+
+/*
+ * page answered for code, file read in memory.
+ * Return NULL with errno set on failure.
+ */
+struct errpage *
+errpage_load(int code, const char *file)
+{
+	struct errpage *e;
+	struct stat st;
+	ssize_t n;
+	size_t off;
+	int fd;
+
+	if (code < 400 || code >= STATUS_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((fd = open(file, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	XCALLOC(e, 1, sizeof(*e));
+	XMALLOC(e->body, st.st_size + 1);
+	for (off = 0; off < (size_t)st.st_size; off += n)
+		if ((n = read(fd, e->body + off, st.st_size - off)) <= 0) {
+			if (n == 0)
+				errno = EIO;
+			close(fd);
+			free(e->body);
+			free(e);
+			return NULL;
+		}
+	close(fd);
+
+	e->code = code;
+	e->blen = st.st_size;
+	errpage_head(e, get_mime_type((char *)file));
+
+	return e;
+}
+
+/*
+ * free the pages of a vhost
+ */
+void
+errpage_free(struct errpage *e)
+{
+	struct errpage *next;
+
+	for (; e; e = next)
+	{
+		next = e->next;
+		free(e->hdrs);
+		free(e->body);
+		free(e);
+	}
+}
+
+/*
+ * template of code, the 500 one for unknown codes
+ */
+const struct tmpl *
+tmpl_status(int code)
+{
+	if (code < 0 || code >= STATUS_MAX || !tmpls[code].data)
+		code = 500;
+	return &tmpls[code];
+}
+
+const char *
+status_get(int code)
+{
+	if (code < 0 || code >= STATUS_MAX)
+		return NULL;
+	return messages[code];
+}
+
+/*
+ * default page of code, the 500 one for unknown codes
+ */
+const struct errpage *
+tmpl_error(int code)
+{
+	if (code < 0 || code >= STATUS_MAX || !errors[code].body)
+		code = 500;
+	return &errors[code];
+}
@@ -0,0 +1,35 @@
+#ifndef H_TMPL
+#define H_TMPL
+
+#include <stddef.h>
+
+#define STATUS_MAX	600		/* status codes are below */
+
+/*
+ * pre-serialized response head : status line, Server and a Date slot
+ * patched with the shared clock of date_now()
+ */
+struct tmpl {
+	char	*data;
+	size_t	len;
+	size_t	date;		/* offset of the Date value */
+};
+
+/* an error body with its Content-Type and Content-Length lines */
+struct errpage {
+	int				code;
+	char			*hdrs;
+	size_t			hlen;
+	char			*body;
+	size_t			blen;
+	struct errpage	*next;		/* pages of a vhost */
+};
+
+void tmpl_init(void);
+const struct tmpl *tmpl_status(int);
+const char *status_get(int);
+const struct errpage *tmpl_error(int);
+struct errpage *errpage_load(int, const char *);
+void errpage_free(struct errpage *);
+
+#endif /* H_TMPL */
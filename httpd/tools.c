@@ -16,18 +16,12 @@
 
 #include <stdio.h>
 #include <stdarg.h>
-#include <libgen.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "httpd.h"
 #include "client.h"
-
-static struct mime_type {
-	const char *ext;
-	const char *val;
-} m_type[] = {
-#include "mime_types.h"
-};
+#include "mime.h"
 
 char **
 splitstr(struct Client *c, char *str, const char *sep, size_t *n)
@@ -72,12 +66,9 @@ zasprintf(struct Client *c, char **ptr, const char *fmt, ...)
 	int ret = 0;
 	
 	va_start(args, fmt);
-	ret = vasprintf(ptr, fmt, args);
+	ret = arena_vasprintf(&c->mem, ptr, fmt, args);
 	va_end(args);
 
-	if (*ptr)
-		mstack_push(c, *ptr);
-
 	return ret;
 }
 
@@ -89,40 +80,138 @@ zwrite(struct Client *c, const char *fmt, ...)
 	int n;
 
 	va_start(args, fmt);
-	n = vasprintf(&ptr, fmt, args);
+	n = arena_vasprintf(&c->mem, &ptr, fmt, args);
 	va_end(args);
 
 	if (ptr && n > 0)
+		client_write(c, ptr, n);
+}
+
+/*
+ * in place : collapse '//', drop '.' segments and resolve '..' ones
+ * without going above '/'
+ */
+void
+uri_normalize(char *uri)
+{
+	char *r, *w;
+
+	for (r = w = uri; *r;)
 	{
-		mstack_push(c, ptr);
-		HTTPD_WRITE(c, ptr, n);
+		if (*r != '/') {
+			*w++ = *r++;
+			continue;
+		}
+
+		/* r is on a '/', look at the segment following it */
+		if (r[1] == '/')
+			r++;
+		else if (r[1] == '.' && (r[2] == '/' || r[2] == '\0'))
+			r += 2;
+		else if (r[1] == '.' && r[2] == '.' && (r[3] == '/' || r[3] == '\0')) {
+			r += 3;
+			while (w > uri && *--w != '/')
+				;
+		}
+		else
+			*w++ = *r++;
 	}
+
+	if (w == uri)
+		*w++ = '/';
+	*w = '\0';
 }
 
 char *
 get_date(char *date)
 {
-	time_t ts;
-	ts = time(NULL);
-	strftime(date, sizeof(char)*35, "%a, %d %b %Y %X GMT", gmtime(&ts));
+	memcpy(date, date_now(), DATE_LEN + 1);
 	return date;
 }
 
+/*
+ * HTTP date of t in date, DATE_LEN + 1 bytes
+ */
+char *
+date_format(time_t t, char *date)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(date, DATE_LEN + 1, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	return date;
+}
+
+/*
+ * time of an HTTP date in any of its three formats, -1 if invalid
+ */
+time_t
+date_parse(const char *date)
+{
+	static const char *formats[] = {
+		"%a, %d %b %Y %H:%M:%S GMT",	/* IMF-fixdate */
+		"%A, %d-%b-%y %H:%M:%S GMT",	/* RFC 850 */
+		"%a %b %e %H:%M:%S %Y",			/* asctime() */
+		NULL
+	};
+	struct tm tm;
+	const char *end;
+	int i;
+
+	for (i = 0; formats[i]; i++)
+	{
+		memset(&tm, 0, sizeof(tm));
+		if ((end = strptime(date, formats[i], &tm)) && *end == '\0')
+			return timegm(&tm);
+	}
+
+	return -1;
+}
+
+#define DATE_SLOTS	4
+
+static char dates[DATE_SLOTS][DATE_LEN + 1];
+static time_t date_sec[DATE_SLOTS];
+static unsigned int date_cur;		/* published slot */
+static int date_busy;
+
+/*
+ * HTTP date of the current second, formatted once per second by the
+ * first thread to see it change and published to every worker without
+ * a lock. A returned string stays valid DATE_SLOTS - 1 seconds.
+ */
+const char *
+date_now(void)
+{
+	time_t now = time(NULL);
+	unsigned int cur, next;
+
+	cur = __atomic_load_n(&date_cur, __ATOMIC_ACQUIRE) % DATE_SLOTS;
+	if (date_sec[cur] == now)
+		return dates[cur];
+
+	/* someone else is formatting it, the previous second will do */
+	if (__atomic_exchange_n(&date_busy, 1, __ATOMIC_ACQUIRE))
+		return dates[cur];
+
+	next = (cur + 1) % DATE_SLOTS;
+	date_format(now, dates[next]);
+	date_sec[next] = now;
+
+	__atomic_store_n(&date_cur, next, __ATOMIC_RELEASE);
+	__atomic_store_n(&date_busy, 0, __ATOMIC_RELEASE);
+
+	return dates[next];
+}
+
 const char *
 get_mime_type(char *path)
 {
-	size_t i;
-	char *ext;
-
-	if ((ext = basename(path)) &&
-			(ext = strrchr(ext, '.'))) {
-		ext++;
-		for (i = 0; i < sizeof(m_type)/sizeof(*m_type); i++)
-		{
-			if (!strcmp(m_type[i].ext, ext))
-				return m_type[i].val;
-		}
-	}
+	const char *ext, *type;
+
+	if ((ext = strrchr(path, '.')) && !strchr(ext, '/') &&
+			(type = mime_lookup(conf.mime, ext + 1)))
+		return type;
 
 	return "text/plain; charset=utf-8";
 }
@@ -4,7 +4,13 @@
 char **splitstr(struct Client *, char *, const char *, size_t *);
 int zasprintf(struct Client *, char **, const char *, ...);
 void zwrite(struct Client *, const char *, ...);
+void uri_normalize(char *);
+#define DATE_LEN	29	/* "Sun, 06 Nov 1994 08:49:37 GMT" */
+
 char *get_date(char *);
+const char *date_now(void);
+char *date_format(time_t, char *);
+time_t date_parse(const char *);
 const char *get_mime_type(char *);
 const char *get_ipstring(struct sockaddr_storage *, char *);
 
@@ -0,0 +1,739 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * io_uring engine : every worker owns a ring with a multishot accept
+ * on each of its registered listening sockets and a multishot recv per
+ * connection filling buffers of a provided ring. Received bytes are fed
+ * to client_handle(), responses are still sent by client_flush() and a
+ * blocked one waits on a poll of the ring. Timeouts are the ones of the
+ * epoll engine (event.c).
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "metrics.h"
+
+#if defined (__linux__)
+#include <linux/io_uring.h>
+#endif
+
+#if defined (IORING_RECV_MULTISHOT) && defined (__NR_io_uring_setup)
+
+#define URING_ENTRIES	256
+#define URING_BUFS		256		/* provided buffers, power of 2 */
+#define URING_BUFSZ		BUFSIZ
+#define URING_BGID		0
+#define URING_FILES		256		/* listening sockets of a ring */
+
+/* completion owner, in the low bits of user_data */
+enum { UD_CANCEL, UD_ACCEPT, UD_RECV, UD_POLL, UD_WAKE };
+
+#define UD(p, t)		((uint64_t)(uintptr_t)(p) | (t))
+#define UD_TYPE(u)		((int)((u) & 7))
+#define UD_PTR(u)		((void *)(uintptr_t)((u) & ~(uint64_t)7))
+#define UD_IDX(u)		((int)((u) >> 3))
+
+/* client uflags */
+#define UF_RECV		0x01	/* multishot recv armed */
+#define UF_POLL		0x02	/* waiting to send */
+#define UF_CLOSE	0x04	/* destroyed once its operations end */
+
+struct uring {
+	int						fd;
+	void					*map;
+	size_t					mlen;
+	unsigned				*sq_head;
+	unsigned				*sq_tail;
+	unsigned				sq_mask;
+	unsigned				sq_entries;
+	struct io_uring_sqe		*sqes;
+	unsigned				*cq_head;
+	unsigned				*cq_tail;
+	unsigned				cq_mask;
+	struct io_uring_cqe		*cqes;
+	struct io_uring_buf_ring *br;		/* provided buffers */
+	unsigned short			br_tail;
+	char					*bufs;
+	struct listener			*ls[URING_FILES];	/* by registered file index */
+	char					armed[URING_FILES];	/* accept pending */
+	char					once[URING_FILES];	/* admitted before each accept */
+	char					drop[URING_FILES];	/* reloaded away, free once idle */
+	int						nls;		/* slots ever used */
+};
+
+static int uring_setup(struct uring *);
+static void uring_free(struct uring *);
+static struct io_uring_sqe *uring_sqe(struct uring *);
+static unsigned uring_queued(struct uring *);
+static void uring_watch(struct worker *, struct listener *, int);
+static int uring_file(struct uring *, int, int);
+static void uring_accept_arm(struct worker *, int);
+static void uring_accept(struct worker *, struct io_uring_cqe *);
+static void uring_accept_once(struct worker *, int);
+static void uring_client(struct worker *, struct listener *, int);
+static void uring_recv_arm(struct worker *, struct Client *);
+static void uring_recv(struct worker *, struct Client *, struct io_uring_cqe *);
+static void uring_poll(struct worker *, struct Client *, struct io_uring_cqe *);
+static void uring_handle(struct worker *, struct Client *);
+static void uring_cancel(struct worker *, uint64_t);
+static void uring_wake_arm(struct worker *);
+static void uring_resume(struct worker *);
+static void uring_buf_put(struct uring *, int);
+
+static int
+sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned submit, unsigned wait, unsigned flags,
+		void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, wait, flags, arg, argsz);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+/*
+ * 1 if this kernel runs the engine, the epoll one is used otherwise
+ */
+int
+uring_probe(void)
+{
+	struct uring r;
+
+	if (uring_setup(&r) == -1)
+		return 0;
+	uring_free(&r);
+	return 1;
+}
+
+void *
+uring_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct uring *r;
+	struct io_uring_getevents_arg ea;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe cqe;
+	unsigned head, tail;
+	int fds[URING_FILES], i;
+
+	XCALLOC(r, 1, sizeof(*r));
+	if (uring_setup(r) == -1)
+		err(EXIT_FAILURE, "io_uring");
+	w->ring = r;
+	timer_init(&w->tw, timer_ticks());
+
+	/* the worker listening sockets, accepted on by file index */
+	for (i = 0; i < URING_FILES; i++)
+		fds[i] = -1;
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_FILES, fds, URING_FILES) == -1)
+		err(EXIT_FAILURE, "io_uring_register");
+
+	worker_sync(w, uring_watch);
+	uring_wake_arm(w);
+
+	memset(&ea, 0, sizeof(ea));
+	for (;;)
+	{
+		/* submit and wait in one call, one tick at most with timers */
+		ts.tv_sec = TIMER_TICK / 1000;
+		ts.tv_nsec = (TIMER_TICK % 1000) * 1000000;
+		ea.ts = w->tw.count ? (uint64_t)(uintptr_t)&ts : 0;
+		if (sys_io_uring_enter(r->fd, uring_queued(r), 1,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				&ea, sizeof(ea)) == -1 &&
+				errno != EINTR && errno != ETIME && errno != EBUSY)
+			err(EXIT_FAILURE, "io_uring_enter");
+
+		head = *r->cq_head;
+		tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			/* copied, the slot is given back before handling it */
+			cqe = r->cqes[head & r->cq_mask];
+			__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+			switch (UD_TYPE(cqe.user_data)) {
+				case UD_ACCEPT:
+					uring_accept(w, &cqe);
+					break;
+				case UD_RECV:
+					uring_recv(w, UD_PTR(cqe.user_data), &cqe);
+					break;
+				case UD_POLL:
+					uring_poll(w, UD_PTR(cqe.user_data), &cqe);
+					break;
+				case UD_WAKE:
+					if (!(cqe.flags & IORING_CQE_F_MORE))
+						uring_wake_arm(w);
+					uring_resume(w);
+					break;
+				default:
+					break;
+			}
+		}
+
+		event_expire(w);
+	}
+
+	return NULL;
+}
+
+/*
+ * end of a connection, freed once the ring does not refer to it
+ */
+void
+uring_close(struct worker *w, struct Client *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if (c->uflags & UF_CLOSE)
+		return;
+	c->uflags |= UF_CLOSE;
+
+	if (c->uops == 0) {
+		client_destroy(c);
+		return;
+	}
+
+	sqe = uring_sqe(w->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = c->fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	sqe->user_data = UD(NULL, UD_CANCEL);
+}
+
+/*
+ * register l in a free slot and accept on it, or unregister it. A
+ * pending accept is cancelled, the slot is reused once it ended.
+ */
+static void
+uring_watch(struct worker *w, struct listener *l, int on)
+{
+	struct uring *r = w->ring;
+	int i;
+
+	if (on) {
+		for (i = 0; i < URING_FILES && (r->ls[i] || r->drop[i]); i++)
+			;
+		if (i == URING_FILES) {
+			warnx("worker %d: more than %d listeners", w->id, URING_FILES);
+			return;
+		}
+		if (uring_file(r, i, l->fds[w->id]) == -1) {
+			warn("io_uring_register");
+			return;
+		}
+		/* capped and left queued at capacity, as the epoll engine */
+		r->once[i] = conf.retry_after == 0 &&
+			(conf.max_conn != (size_t)-1 || l->opt.max_conn > 0);
+		r->ls[i] = l;
+		r->nls = MAX(r->nls, i + 1);
+		uring_accept_arm(w, i);
+		return;
+	}
+
+	for (i = 0; i < r->nls && (r->ls[i] != l || r->drop[i]); i++)
+		;
+	if (i == r->nls)
+		return;
+
+	if (uring_file(r, i, -1) == -1)
+		warn("io_uring_register");
+	if (r->armed[i]) {
+		r->drop[i] = 1;
+		uring_cancel(w, ((uint64_t)i << 3) | UD_ACCEPT);
+	}
+	else
+		r->ls[i] = NULL;
+}
+
+/*
+ * set the registered file of slot i, -1 to clear it
+ */
+static int
+uring_file(struct uring *r, int i, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+
+	return sys_io_uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+}
+
+static void
+uring_accept_arm(struct worker *w, int i)
+{
+	struct uring *r = w->ring;
+	struct io_uring_sqe *sqe;
+
+	if (r->armed[i])
+		return;
+	r->armed[i] = 1;
+
+	sqe = uring_sqe(r);
+	sqe->fd = i;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->user_data = ((uint64_t)i << 3) | UD_ACCEPT;
+
+	/* readiness only, a slot is taken before accepting */
+	if (r->once[i]) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+static void
+uring_accept(struct worker *w, struct io_uring_cqe *cqe)
+{
+	struct uring *r = w->ring;
+	struct listener *l;
+	int i, fd;
+
+	i = UD_IDX(cqe->user_data);
+	l = r->ls[i];
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		r->armed[i] = 0;
+
+	/* the socket of a dropped listener may be closed already */
+	if (r->once[i]) {
+		if (!r->drop[i])
+			uring_accept_once(w, i);
+	}
+	else if ((fd = cqe->res) < 0) {
+		if (fd != -ECANCELED)
+			metrics_accept(0);
+	}
+	/* uncapped, or capped with retry-after set */
+	else if (!conn_admit(l))
+		conn_shed(fd);
+	else
+		uring_client(w, l, fd);
+
+	if (r->drop[i]) {
+		if (!r->armed[i]) {
+			r->ls[i] = NULL;
+			r->drop[i] = 0;
+		}
+	}
+	else if (!r->armed[i] && !l->off[w->id])
+		uring_accept_arm(w, i);
+}
+
+/*
+ * capped listener ready, accept as long as there are slots as the
+ * epoll engine does
+ */
+static void
+uring_accept_once(struct worker *w, int i)
+{
+	struct listener *l = w->ring->ls[i];
+	int fd;
+
+	for (;;)
+	{
+		if (!conn_admit(l)) {
+			worker_pause(w, l);
+			if (!conn_full(l))
+				uring_resume(w);
+			return;
+		}
+
+		if ((fd = accept4(l->fds[w->id], NULL, NULL,
+						SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+			conn_release(l);
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				metrics_accept(0);
+			return;
+		}
+
+		uring_client(w, l, fd);
+	}
+}
+
+static void
+uring_client(struct worker *w, struct listener *l, int fd)
+{
+	struct Client *c;
+	socklen_t len;
+
+	metrics_accept(1);
+	c = client_new();
+	len = sizeof(c->ss);
+	getpeername(fd, (struct sockaddr *)&c->ss, &len);
+	c->fd = fd;
+	c->w = w;
+	c->l = l;
+	c->tm.arg = c;
+	c->feed = 1;
+
+	pthread_mutex_lock(&httpd_mtx);
+	CLIENT_ADD(c);
+	c->vc = vconf_get();
+	pthread_mutex_unlock(&httpd_mtx);
+
+	uring_recv_arm(w, c);
+	event_arm(w, c);
+}
+
+static void
+uring_recv_arm(struct worker *w, struct Client *c)
+{
+	struct io_uring_sqe *sqe;
+
+	c->uflags |= UF_RECV;
+	c->uops++;
+
+	sqe = uring_sqe(w->ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->user_data = UD(c, UD_RECV);
+}
+
+static void
+uring_recv(struct worker *w, struct Client *c, struct io_uring_cqe *cqe)
+{
+	struct uring *r = w->ring;
+	int bid;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		c->uflags &= ~UF_RECV;
+		c->uops--;
+	}
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (cqe->res > 0 && !(c->uflags & UF_CLOSE))
+			client_feed(c, r->bufs + bid * URING_BUFSZ, cqe->res);
+		uring_buf_put(r, bid);
+	}
+
+	if (c->uflags & UF_CLOSE) {
+		if (c->uops == 0)
+			client_destroy(c);
+		return;
+	}
+
+	if (cqe->res == 0)
+		c->feed = -1;
+	else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		event_close(w, c);
+		return;
+	}
+
+	/* kept until the response is sent */
+	if (c->uflags & UF_POLL) {
+		if ((c->uflags & UF_RECV) && c->rlen >= conf.max_header_size)
+			uring_cancel(w, UD(c, UD_RECV));
+		return;
+	}
+
+	uring_handle(w, c);
+}
+
+static void
+uring_poll(struct worker *w, struct Client *c, struct io_uring_cqe *cqe)
+{
+	(void)cqe;
+
+	c->uflags &= ~UF_POLL;
+	c->uops--;
+
+	if (c->uflags & UF_CLOSE) {
+		if (c->uops == 0)
+			client_destroy(c);
+		return;
+	}
+
+	uring_handle(w, c);
+}
+
+/*
+ * run the connection, then wait for the socket to drain or more input
+ */
+static void
+uring_handle(struct worker *w, struct Client *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if (client_handle(c) == -1) {
+		event_close(w, c);
+		return;
+	}
+
+	if (c->state == CL_WRITE || c->oqlen > 0) {
+		c->uflags |= UF_POLL;
+		c->uops++;
+		sqe = uring_sqe(w->ring);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = c->fd;
+		sqe->poll32_events = POLLOUT;
+		sqe->user_data = UD(c, UD_POLL);
+
+		/* stop reading ahead of a slow reader */
+		if ((c->uflags & UF_RECV) && c->rlen >= conf.max_header_size)
+			uring_cancel(w, UD(c, UD_RECV));
+	}
+	else if (!(c->uflags & UF_RECV))
+		uring_recv_arm(w, c);
+
+	event_arm(w, c);
+}
+
+static void
+uring_cancel(struct worker *w, uint64_t ud)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(w->ring);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = ud;
+	sqe->user_data = UD(NULL, UD_CANCEL);
+}
+
+static void
+uring_wake_arm(struct worker *w)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_sqe(w->ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = w->wake[0];
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = UD(NULL, UD_WAKE);
+}
+
+/*
+ * a connection closed : accept again on the listeners turned off.
+ * Or the listeners were reloaded.
+ */
+static void
+uring_resume(struct worker *w)
+{
+	struct uring *r = w->ring;
+	char buf[64];
+	int i;
+
+	while (read(w->wake[0], buf, sizeof(buf)) > 0)
+		;
+
+	if (__atomic_exchange_n(&w->reload, 0, __ATOMIC_SEQ_CST))
+		worker_sync(w, uring_watch);
+
+	if (!worker_resume(w))
+		return;
+
+	for (i = 0; i < r->nls; i++)
+	{
+		if (!r->ls[i] || r->drop[i] || !r->ls[i]->off[w->id])
+			continue;
+		r->ls[i]->off[w->id] = 0;
+		uring_accept_arm(w, i);
+	}
+}
+
+/*
+ * next free submission entry, read by the kernel in io_uring_enter()
+ * only (no SQPOLL)
+ */
+static struct io_uring_sqe *
+uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	tail = *r->sq_tail;
+	while (uring_queued(r) >= r->sq_entries)
+		if (sys_io_uring_enter(r->fd, r->sq_entries, 0, 0, NULL, 0) == -1 &&
+				errno != EINTR && errno != EBUSY)
+			err(EXIT_FAILURE, "io_uring_enter");
+
+	sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+/*
+ * entries not consumed by the kernel yet
+ */
+static unsigned
+uring_queued(struct uring *r)
+{
+	return *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void
+uring_buf_put(struct uring *r, int bid)
+{
+	struct io_uring_buf *b;
+
+	b = &r->br->bufs[r->br_tail & (URING_BUFS - 1)];
+	b->addr = (uint64_t)(uintptr_t)(r->bufs + bid * URING_BUFSZ);
+	b->len = URING_BUFSZ;
+	b->bid = bid;
+	__atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * create the ring, map it and register its provided buffers
+ */
+static int
+uring_setup(struct uring *r)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	unsigned *sq_array;
+	unsigned i;
+
+	memset(r, 0, sizeof(*r));
+
+	/* task work on the worker thread only, when the kernel knows it */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+		IORING_SETUP_DEFER_TASKRUN;
+	p.cq_entries = URING_ENTRIES * 8;
+	if ((r->fd = sys_io_uring_setup(URING_ENTRIES, &p)) == -1 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_ENTRIES * 8;
+		r->fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	}
+	if (r->fd == -1)
+		return -1;
+	r->sq_entries = p.sq_entries;
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+			!(p.features & IORING_FEAT_EXT_ARG) ||
+			!(p.features & IORING_FEAT_NODROP)) {
+		close(r->fd);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	r->mlen = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+			p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	r->map = mmap(NULL, r->mlen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+			IORING_OFF_SQES);
+	if (r->map == MAP_FAILED || r->sqes == MAP_FAILED)
+		goto fail;
+
+	r->sq_head = (unsigned *)((char *)r->map + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->map + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)((char *)r->map + p.sq_off.ring_mask);
+	r->cq_head = (unsigned *)((char *)r->map + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->map + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)((char *)r->map + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->map + p.cq_off.cqes);
+
+	/* sqes are used in order */
+	sq_array = (unsigned *)((char *)r->map + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	r->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (r->br == MAP_FAILED)
+		goto fail;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+		goto fail;
+
+	XMALLOC(r->bufs, URING_BUFS * URING_BUFSZ);
+	for (i = 0; i < URING_BUFS; i++)
+		uring_buf_put(r, i);
+
+	return 0;
+
+fail:
+	i = errno;
+	uring_free(r);
+	errno = i;
+	return -1;
+}
+
+static void
+uring_free(struct uring *r)
+{
+	if (r->br && r->br != MAP_FAILED)
+		munmap(r->br, URING_BUFS * sizeof(struct io_uring_buf));
+	if (r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+	if (r->map && r->map != MAP_FAILED)
+		munmap(r->map, r->mlen);
+	free(r->bufs);
+	close(r->fd);
+}
+
+#else
+
+int
+uring_probe(void)
+{
+	return 0;
+}
+
+void *
+uring_loop(void *arg)
+{
+	return arg;
+}
+
+void
+uring_close(struct worker *w, struct Client *c)
+{
+	(void)w;
+	client_destroy(c);
+}
+
+#endif /* IORING_RECV_MULTISHOT */
@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2010 Philippe Pepiot <phil@philpep.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Virtual hosts : exact names in a hash table, "*.domain" wildcards in a
+ * label trie walked from the top level domain, "*" as the default.
+ * Names are case insensitive. A configuration load builds its own
+ * tables (struct vconf), never written once published and freed with
+ * their last reference. Roots and names outlive a load : an unchanged
+ * root keeps its descriptor and cached files, a name its metrics.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "httpd.h"
+#include "client.h"
+#include "fcache.h"
+#include "tmpl.h"
+
+#define VH_NAME_MAX	255
+
+/* hash chain and hash, first member of vhost, vroot, vnode and vname */
+struct hlink {
+	struct hlink	*next;
+	unsigned int	hash;
+};
+
+/* trie node, a label below its parent, nodes are found by hashing both */
+struct vnode {
+	struct vnode	*hnext;
+	unsigned int	hash;
+	struct vnode	*parent;
+	char			*label;
+	struct vhost	*wild;		/* "*." this node */
+};
+
+/* a host name, one copy for every load */
+struct vname {
+	struct vname	*hnext;
+	unsigned int	hash;
+	char			*name;
+};
+
+struct vtable {
+	struct vhost	**names;
+	size_t			nnames;
+	size_t			nmask;
+	struct vnode	**nodes;
+	size_t			nnodes;
+	size_t			dmask;
+	struct vhost	*def;		/* "*" */
+};
+
+/* open roots, by path */
+static struct vroot **roots;
+static size_t nroots;
+static size_t rmask;
+static pthread_mutex_t root_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/* interned names, only used by the parser */
+static struct vname **names;
+static size_t nnames;
+static size_t nmask;
+
+static unsigned int vhost_hash(const char *, size_t, unsigned int);
+static void *vhost_grow(void *, size_t *, size_t);
+static struct vnode *node_find(struct vtable *, struct vnode *, const char *,
+		size_t, int);
+static const char *name_intern(char *);
+static struct vroot *root_get(const char *);
+static void root_put(struct vroot *);
+static void vconf_free(struct vconf *);
+
+/* FNV-1a */
+static unsigned int
+vhost_hash(const char *s, size_t len, unsigned int h)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+
+	return h;
+}
+
+/*
+ * add host serving root to vc, both strings are kept.
+ * Return NULL with errno set if root can not be used.
+ */
+struct vhost *
+vhost_add(struct vconf *vc, char *host, char *root)
+{
+	struct vtable *t = vc->vtab;
+	struct vhost *vh, **vp;
+	struct vnode *n;
+	struct vroot *vr;
+	unsigned int h;
+	const char *name, *p, *end;
+	char *q;
+
+	if (!strcmp(host, "*.")) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (!(vr = root_get(root)))
+		return NULL;
+
+	for (q = host; *q; q++)
+		*q = tolower((unsigned char)*q);
+	name = name_intern(host);
+
+	XCALLOC(vh, 1, sizeof(*vh));
+	vh->host = name;
+	vh->root = root;
+	vh->vr = vr;
+	TAILQ_INSERT_TAIL(&vc->vhosts, vh, entry);
+
+	/* the last definition of a name wins */
+	if (!strcmp(name, "*")) {
+		t->def = vh;
+		return vh;
+	}
+
+	if (!strncmp(name, "*.", 2))
+	{
+		/* walk the labels from the right */
+		n = NULL;
+		end = name + strlen(name);
+		while (end > name + 2)
+		{
+			for (p = end; p > name + 2 && p[-1] != '.'; p--)
+				;
+			n = node_find(t, n, p, end - p, 1);
+			end = p - 1;
+		}
+		if (n)
+			n->wild = vh;
+		return vh;
+	}
+
+	t->names = vhost_grow(t->names, &t->nmask, t->nnames + 1);
+	vh->hash = h = vhost_hash(name, strlen(name), 2166136261u);
+	for (vp = &t->names[h & t->nmask]; *vp; vp = &(*vp)->hnext)
+		if ((*vp)->host == name) {
+			vh->hnext = (*vp)->hnext;
+			*vp = vh;
+			return vh;
+		}
+	*vp = vh;
+	t->nnames++;
+
+	return vh;
+}
+
+/*
+ * vhost of a Host value without its port : exact name, then the
+ * longest wildcard, then the default one
+ */
+struct vhost *
+vhost_find(const struct vconf *vc, const char *name)
+{
+	struct vtable *t = vc->vtab;
+	struct vhost *vh, *wild = NULL;
+	struct vnode *n = NULL;
+	char host[VH_NAME_MAX + 1];
+	size_t len, i;
+	char *p, *end;
+
+	for (len = 0; name[len] && len < VH_NAME_MAX; len++)
+		host[len] = tolower((unsigned char)name[len]);
+	if (name[len])
+		return t->def;
+
+	/* absolute name */
+	if (len > 0 && host[len - 1] == '.')
+		len--;
+	host[len] = '\0';
+
+	if (t->names)
+	{
+		i = vhost_hash(host, len, 2166136261u) & t->nmask;
+		for (vh = t->names[i]; vh; vh = vh->hnext)
+			if (!strcmp(vh->host, host))
+				return vh;
+	}
+
+	/* a wildcard needs at least one more label on the left */
+	end = host + len;
+	while (end > host && t->nodes)
+	{
+		for (p = end; p > host && p[-1] != '.'; p--)
+			;
+		if (p == host || !(n = node_find(t, n, p, end - p, 0)))
+			break;
+		if (n->wild)
+			wild = n->wild;
+		end = p - 1;
+	}
+
+	return wild ? wild : t->def;
+}
+
+static struct vnode *
+node_find(struct vtable *t, struct vnode *parent, const char *label,
+		size_t len, int create)
+{
+	struct vnode *n;
+	unsigned int h;
+
+	h = vhost_hash((const char *)&parent, sizeof(parent), 2166136261u);
+	h = vhost_hash(label, len, h);
+
+	if (t->nodes)
+		for (n = t->nodes[h & t->dmask]; n; n = n->hnext)
+			if (n->hash == h && n->parent == parent &&
+					!strncmp(n->label, label, len) && !n->label[len])
+				return n;
+
+	if (!create)
+		return NULL;
+
+	t->nodes = vhost_grow(t->nodes, &t->dmask, t->nnodes + 1);
+
+	XCALLOC(n, 1, sizeof(*n));
+	XMALLOC(n->label, len + 1);
+	memcpy(n->label, label, len);
+	n->label[len] = '\0';
+	n->parent = parent;
+	n->hash = h;
+	n->hnext = t->nodes[h & t->dmask];
+	t->nodes[h & t->dmask] = n;
+	t->nnodes++;
+
+	return n;
+}
+
+/*
+ * empty configuration, referenced once
+ */
+struct vconf *
+vconf_new(void)
+{
+	struct vconf *vc;
+
+	XCALLOC(vc, 1, sizeof(*vc));
+	vc->refs = 1;
+	TAILQ_INIT(&vc->vhosts);
+	XCALLOC(vc->vtab, 1, sizeof(*vc->vtab));
+
+	return vc;
+}
+
+/*
+ * the current configuration, referenced, httpd_mtx held
+ */
+struct vconf *
+vconf_get(void)
+{
+	__atomic_add_fetch(&conf.vc->refs, 1, __ATOMIC_RELAXED);
+	return conf.vc;
+}
+
+void
+vconf_put(struct vconf *vc)
+{
+	if (__atomic_sub_fetch(&vc->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		vconf_free(vc);
+}
+
+static void
+vconf_free(struct vconf *vc)
+{
+	struct vtable *t = vc->vtab;
+	struct vhost *vh;
+	struct vnode *n, *next;
+	size_t i;
+
+	for (i = 0; t->nodes && i <= t->dmask; i++)
+		for (n = t->nodes[i]; n; n = next)
+		{
+			next = n->hnext;
+			free(n->label);
+			free(n);
+		}
+	free(t->nodes);
+	free(t->names);
+	free(t);
+
+	while ((vh = TAILQ_FIRST(&vc->vhosts)))
+	{
+		TAILQ_REMOVE(&vc->vhosts, vh, entry);
+		root_put(vh->vr);
+		errpage_free(vh->errors);
+		free(vh->root);
+		free(vh->logfile);
+		free(vh->logfmt);
+		free(vh);
+	}
+
+	free(vc);
+}
+
+/*
+ * the one copy of name, name is freed if it is known already
+ */
+static const char *
+name_intern(char *name)
+{
+	struct vname *n;
+	unsigned int h;
+
+	h = vhost_hash(name, strlen(name), 2166136261u);
+
+	if (names)
+		for (n = names[h & nmask]; n; n = n->hnext)
+			if (n->hash == h && !strcmp(n->name, name)) {
+				free(name);
+				return n->name;
+			}
+
+	names = vhost_grow(names, &nmask, nnames + 1);
+
+	XCALLOC(n, 1, sizeof(*n));
+	n->hash = h;
+	n->name = name;
+	n->hnext = names[h & nmask];
+	names[h & nmask] = n;
+	nnames++;
+
+	return name;
+}
+
+/*
+ * referenced root for root as written in the configuration, the open
+ * one if it still is the same directory
+ */
+static struct vroot *
+root_get(const char *root)
+{
+	struct vroot *vr;
+	struct stat st;
+	char path[PATH_MAX];
+	unsigned int h;
+	int fd;
+
+	if (!realpath(root, path) ||
+			(fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) == -1 || !S_ISDIR(st.st_mode)) {
+		close(fd);
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	h = vhost_hash(path, strlen(path), 2166136261u);
+
+	pthread_mutex_lock(&root_mtx);
+
+	if (roots)
+		for (vr = roots[h & rmask]; vr; vr = vr->hnext)
+			if (vr->hash == h && vr->dev == st.st_dev &&
+					vr->ino == st.st_ino && !strcmp(vr->path, path)) {
+				vr->refs++;
+				pthread_mutex_unlock(&root_mtx);
+				close(fd);
+				return vr;
+			}
+
+	roots = vhost_grow(roots, &rmask, nroots + 1);
+
+	XCALLOC(vr, 1, sizeof(*vr));
+	vr->hash = h;
+	XSTRDUP(vr->path, path);
+	vr->len = strlen(path);
+	vr->fd = fd;
+	vr->dev = st.st_dev;
+	vr->ino = st.st_ino;
+	vr->refs = 1;
+	vr->hnext = roots[h & rmask];
+	roots[h & rmask] = vr;
+	nroots++;
+
+	pthread_mutex_unlock(&root_mtx);
+
+	return vr;
+}
+
+/*
+ * last vhost of vr gone, its cached files go with it
+ */
+static void
+root_put(struct vroot *vr)
+{
+	struct vroot **vp;
+
+	pthread_mutex_lock(&root_mtx);
+	if (--vr->refs > 0) {
+		pthread_mutex_unlock(&root_mtx);
+		return;
+	}
+	for (vp = &roots[vr->hash & rmask]; *vp != vr; vp = &(*vp)->hnext)
+		;
+	*vp = vr->hnext;
+	nroots--;
+	pthread_mutex_unlock(&root_mtx);
+
+	fcache_forget(vr);
+	close(vr->fd);
+	free(vr->path);
+	free(vr);
+}
+
+/*
+ * double the power of two hash table tab when it would hold more than
+ * one element per bucket
+ */
+static void *
+vhost_grow(void *tab, size_t *mask, size_t count)
+{
+	struct hlink **otab = tab, **ntab, *e, *next;
+	size_t size, i;
+
+	if (otab && count <= *mask + 1)
+		return otab;
+
+	size = otab ? (*mask + 1) * 2 : 64;
+	XCALLOC(ntab, size, sizeof(*ntab));
+
+	for (i = 0; otab && i <= *mask; i++)
+		for (e = otab[i]; e; e = next)
+		{
+			next = e->next;
+			e->next = ntab[e->hash & (size - 1)];
+			ntab[e->hash & (size - 1)] = e;
+		}
+
+	free(otab);
+	*mask = size - 1;
+	return ntab;
+}